@@ -0,0 +1,173 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <csignal>
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "mTrace.h"
+
+static volatile std::sig_atomic_t keepCapturing = 1;
+
+static void stopCapture(int) {
+    keepCapturing = 0;
+}
+
+static void* mapFile(const std::string& filename, uint64_t size) {
+    int file = open(filename.c_str(), O_RDONLY);
+    if(file < 0) {
+        std::cerr << "Error opening file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if(data == MAP_FAILED) {
+        std::cerr << "Error mapping file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+    return data;
+}
+
+/*
+ * Records the metadata rings of a running application as a trace for replayMerge.
+ * Every interval each ring is snapshotted and every chunk that changed since the
+ * last snapshot is written out with a timestamp. Chunks that went free are skipped,
+ * those were consumed by the application's own merge thread.
+ */
+int main(int argc, char** argv) {
+
+    std::vector<std::string> metadataFiles;
+    std::vector<std::string> dataFiles;
+    std::string traceFile;
+
+    uint64_t dataLogSize = M_CHUNK_COUNT * sizeof(m_chunk);
+    int intervalUs = 1000;
+    double durationS = 10.0;
+    bool captureData = false;
+
+    std::string activeFlag = "";
+    for(int argNum = 0; argNum != argc; ++argNum) {
+        std::string currArg{argv[argNum]};
+        if(currArg == "--captureData") captureData = true;
+        else if(currArg[0] == '-') activeFlag = currArg;
+        else if(activeFlag == "--metadataFiles") {
+            metadataFiles.push_back(std::move(currArg));
+        }
+        else if(activeFlag == "--dataFiles") {
+            dataFiles.push_back(std::move(currArg));
+        }
+        else if(activeFlag == "--traceFile") {
+            traceFile = std::move(currArg);
+        }
+        else if(activeFlag == "--dataLogSize") {
+            dataLogSize = std::stoull(currArg);
+        }
+        else if(activeFlag == "--intervalUs") {
+            intervalUs = std::stoi(currArg);
+        }
+        else if(activeFlag == "--duration") {
+            durationS = std::stod(currArg);
+        }
+    }
+
+    if(metadataFiles.empty() || traceFile == "" || (captureData && dataFiles.size() != metadataFiles.size())) {
+        std::cerr << "Usage: captureLogs --traceFile <file> --metadataFiles <files...> [--dataFiles <files...> --captureData]\n" <<
+            "\t[--dataLogSize <bytes>] [--intervalUs <us>] [--duration <s>]\n";
+        return 1;
+    }
+
+    std::vector<m_chunk*> metadata;
+    for(const auto& filename : metadataFiles) {
+        auto* chunks = static_cast<m_chunk*>(mapFile(filename, M_CHUNK_COUNT * sizeof(m_chunk)));
+        if(chunks == nullptr) return 1;
+        metadata.push_back(chunks);
+    }
+
+    std::vector<char*> data;
+    if(captureData) {
+        for(const auto& filename : dataFiles) {
+            auto* logData = static_cast<char*>(mapFile(filename, dataLogSize));
+            if(logData == nullptr) return 1;
+            data.push_back(logData);
+        }
+    }
+
+    std::ofstream out{traceFile, std::ios::binary};
+    if(!out.good()) {
+        std::cerr << "Unable to open trace file \"" << traceFile << "\"\n";
+        return 1;
+    }
+
+    m_trace_header header{M_TRACE_MAGIC, M_TRACE_VERSION, metadata.size(),
+        captureData ? static_cast<uint64_t>(M_TRACE_FLAG_DATA) : 0, dataLogSize};
+    out.write(reinterpret_cast<char*>(&header), sizeof(header));
+
+    // every chunk starts out free, so whatever is already in the rings is recorded in the first pass
+    std::vector<std::vector<m_chunk>> snapshots = std::vector<std::vector<m_chunk>>(metadata.size(),
+            std::vector<m_chunk>(M_CHUNK_COUNT, m_chunk{0, 1, 0, 0, 0, 0, {}}));
+
+    std::signal(SIGINT, stopCapture);
+    std::signal(SIGTERM, stopCapture);
+
+    std::cout << "Capturing " << metadata.size() << " logs to \"" << traceFile << "\"...\n";
+
+    uint64_t recordCount = 0;
+    uint64_t dataBytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(durationS));
+    auto nextSnapshot = start;
+
+    while(keepCapturing && std::chrono::steady_clock::now() < end) {
+        for(int logNum = 0; logNum != metadata.size(); ++logNum) {
+            for(int chunkNum = 0; chunkNum != M_CHUNK_COUNT; ++chunkNum) {
+                m_chunk curr = metadata[logNum][chunkNum];
+                auto& prev = snapshots[logNum][chunkNum];
+                if(std::memcmp(&curr, &prev, sizeof(m_chunk)) == 0) continue;
+
+                if(!curr.free && curr.item_count <= M_ITEM_COUNT) {
+                    m_trace_record record{};
+                    record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+                    record.log = logNum;
+                    record.chunk_index = chunkNum;
+                    record.new_chunk = prev.free || curr.item_count < prev.item_count;
+                    record.first_item = record.new_chunk ? 0 : prev.item_count;
+                    record.chunk = curr;
+                    out.write(reinterpret_cast<char*>(&record), sizeof(record));
+
+                    if(captureData) {
+                        for(int itemNum = record.first_item; itemNum < curr.item_count; ++itemNum) {
+                            auto& item = curr.items[itemNum];
+                            if(item.data_offset + curr.req_len > dataLogSize) {
+                                // keep the record layout intact, replay gets zeros
+                                std::vector<char> zeros(curr.req_len, 0);
+                                out.write(zeros.data(), zeros.size());
+                            }
+                            else out.write(data[logNum] + item.data_offset, curr.req_len);
+                            dataBytes += curr.req_len;
+                        }
+                    }
+                    ++recordCount;
+                }
+                prev = curr;
+            }
+        }
+
+        nextSnapshot += std::chrono::microseconds(intervalUs);
+        std::this_thread::sleep_until(nextSnapshot);
+    }
+
+    out.close();
+    std::cout << "Capture complete, " << recordCount << " records, " << dataBytes << " data bytes.\n";
+    return 0;
+}
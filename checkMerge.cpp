@@ -0,0 +1,1156 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mChunk.h"
+#include "merger.h"
+#include "logMapper.h"
+#include "destager.h"
+#include "targetFile.h"
+#include "mergeThread.h"
+#include "mergePolicy.h"
+#include "copyEngine.h"
+#include "mTrace.h"
+
+static int failures = 0;
+// the smartMerge binary the cascade check runs, from --smartMerge
+static std::string smartMergePath;
+// the binaries the trace check runs, from --captureLogs and --replayMerge
+static std::string captureLogsPath;
+static std::string replayMergePath;
+
+#define CHECK(condition) do { \
+        if(!(condition)) { \
+            std::cerr << "checkMerge.cpp:" << __LINE__ << ": check failed: " #condition "\n"; \
+            ++failures; \
+        } \
+    } while(0)
+
+// scratch directory for one check, removed again afterwards
+struct ScratchDir {
+    std::string path;
+
+    ScratchDir() {
+        const char* tmp = std::getenv("TMPDIR");
+        std::string pattern = std::string{tmp != nullptr ? tmp : "/tmp"} + "/checkMerge.XXXXXX";
+        std::vector<char> name{pattern.begin(), pattern.end()};
+        name.push_back('\0');
+        if(mkdtemp(name.data()) == nullptr) perror("Error creating scratch directory:");
+        path = name.data();
+    }
+    ~ScratchDir() {
+        std::error_code error;
+        std::filesystem::remove_all(path, error);
+    }
+};
+
+static std::vector<char> readFile(const std::string& filename) {
+    std::ifstream in{filename, std::ios::binary};
+    return std::vector<char>{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+}
+
+// a source buffer where every int holds its own index, so any misplaced byte shows up
+static std::vector<int> patternBuffer(std::size_t intCount) {
+    std::vector<int> buffer(intCount);
+    for(std::size_t i = 0; i != intCount; ++i) buffer[i] = static_cast<int>(i);
+    return buffer;
+}
+
+// metadata and data logs in a scratch directory, filled the way a producer would.
+// The data of each request holds the int indices of where it lands in the target,
+// so a correct target holds every int's own index
+struct TestLogs {
+    std::vector<std::string> metadataFiles;
+    std::vector<std::string> dataFiles;
+    std::string outDataFile;
+    std::vector<m_chunk*> metadata;
+    std::vector<char*> data;
+    std::vector<uint64_t> currChunks;
+    std::vector<uint64_t> dataUsed;
+    uint64_t dataSize;
+    uint64_t reqLen;
+
+    // data logs are the size the merge thread maps them at
+    TestLogs(const std::string& dir, int logCount, uint64_t reqLen_) :
+        outDataFile{dir + "/out-data"},
+        currChunks(logCount, 0),
+        dataUsed(logCount, 0),
+        dataSize{M_CHUNK_COUNT * sizeof(m_chunk)},
+        reqLen{reqLen_}
+    {
+        for(int logNum = 0; logNum != logCount; ++logNum) {
+            metadataFiles.push_back(dir + "/metadata-log" + std::to_string(logNum));
+            dataFiles.push_back(dir + "/data-log" + std::to_string(logNum));
+            auto* chunks = static_cast<m_chunk*>(create(metadataFiles.back(), M_METADATA_SIZE));
+            for(int i = 0; i != M_CHUNK_COUNT; ++i) {
+                chunks[i].free = 1;
+                chunks[i].next_chunk = (i + 1) % M_CHUNK_COUNT;
+            }
+            metadata.push_back(chunks);
+            data.push_back(static_cast<char*>(create(dataFiles.back(), dataSize)));
+        }
+        munmap(create(outDataFile, M_CHUNK_COUNT * sizeof(m_chunk)), M_CHUNK_COUNT * sizeof(m_chunk));
+    }
+    ~TestLogs() {
+        for(auto* chunks : metadata) munmap(chunks, M_METADATA_SIZE);
+        for(auto* logData : data) munmap(logData, dataSize);
+    }
+
+    static void* create(const std::string& filename, uint64_t size) {
+        int file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if(file < 0 || ftruncate(file, size) != 0) perror("Error creating log:");
+        void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        close(file);
+        return mapped;
+    }
+
+    m_control* control(int log) {
+        return reinterpret_cast<m_control*>(metadata[log] + M_CHUNK_COUNT);
+    }
+
+    // moves on to the next chunk once the merge thread has freed it, leaving the current one as it is
+    // returns false if it wasn't freed in time
+    bool nextChunk(int log) {
+        currChunks[log] = metadata[log][currChunks[log]].next_chunk;
+        auto* chunk = &metadata[log][currChunks[log]];
+        auto start = std::chrono::steady_clock::now();
+        while(!chunk->free) {
+            if(std::chrono::steady_clock::now() - start > std::chrono::seconds(5)) return false;
+            std::this_thread::yield();
+        }
+        chunk->item_count = 0;
+        return true;
+    }
+
+    // appends a request for target offset to the log, moving on from a full chunk first
+    // returns false if the next chunk wasn't freed in time
+    bool write(int log, uint64_t target) {
+        // a full chunk may already have been merged and freed, it's still done with
+        if(metadata[log][currChunks[log]].item_count == M_ITEM_COUNT && !nextChunk(log)) return false;
+        auto* chunk = &metadata[log][currChunks[log]];
+
+        uint64_t dataOffset = dataUsed[log];
+        dataUsed[log] = (dataUsed[log] + reqLen) % dataSize;
+        int* values = reinterpret_cast<int*>(data[log] + dataOffset);
+        for(uint64_t i = 0; i != reqLen / sizeof(int); ++i) values[i] = static_cast<int>(target / sizeof(int) + i);
+
+        chunk->req_len = reqLen;
+        chunk->items[chunk->item_count] = m_item{dataOffset, target};
+        std::atomic_thread_fence(std::memory_order_release);
+        chunk->item_count = chunk->item_count + 1;
+        chunk->free = 0;
+        return true;
+    }
+};
+
+// true if the file holds exactly size bytes of each int's own index
+static bool targetIsComplete(const std::string& filename, uint64_t size) {
+    std::vector<char> written = readFile(filename);
+    if(written.size() != size) return false;
+    const int* values = reinterpret_cast<const int*>(written.data());
+    for(uint64_t i = 0; i != size / sizeof(int); ++i) {
+        if(values[i] != static_cast<int>(i)) return false;
+    }
+    return true;
+}
+
+// writer ranges partition the items, cover disjoint ascending parts of the file even when items overlap,
+// every callback comes before destage returns, each item lands at its target offset, and queued
+// destages are written in the order they were queued
+static void checkDestager() {
+    ScratchDir scratch;
+    std::vector<int> source = patternBuffer(1 << 18);
+
+    std::vector<MergerItem> items;
+    uint64_t target = 0;
+    uint64_t sourceOffset = 0;
+    for(int i = 0; i != 300; ++i) {
+        uint64_t length = 4 * (1 + (i * 37) % 700);
+        target += 4 * ((i * 13) % 50); // leave gaps
+        items.emplace_back(m_item{sourceOffset, target}, source.data(), length);
+        target += length;
+        sourceOffset = (sourceOffset + length * 3) % (source.size() * 4 - 4 * 1024);
+    }
+
+    for(int writerCount : {1, 3, 8}) {
+        std::string targetFile = scratch.path + "/target-" + std::to_string(writerCount);
+        Destager destager{targetFile, writerCount, {}};
+        CHECK(destager.good());
+        CHECK(destager.getWriterCount() == writerCount);
+
+        std::vector<std::pair<std::size_t, std::size_t>> ranges;
+        CHECK(destager.destage(items, [&ranges](std::size_t first, std::size_t last) {
+            ranges.emplace_back(first, last);
+        }));
+        CHECK(ranges.size() <= static_cast<std::size_t>(writerCount));
+
+        std::sort(ranges.begin(), ranges.end());
+        std::size_t next = 0;
+        for(const auto& range : ranges) {
+            CHECK(range.first == next);
+            CHECK(range.second > range.first);
+            next = range.second;
+        }
+        CHECK(next == items.size());
+
+        CHECK(destager.sync());
+        std::vector<char> written = readFile(targetFile);
+        CHECK(written.size() == items.back().getBaseOffset() + items.back().getLength());
+        for(const auto& item : items) {
+            const auto& logItem = item.getLogItems().front();
+            CHECK(std::memcmp(written.data() + item.getBaseOffset(),
+                        reinterpret_cast<char*>(source.data()) + logItem.item.data_offset, item.getLength()) == 0);
+        }
+
+        bool called = false;
+        CHECK(destager.destage(items.data(), items.data(), [&called](std::size_t, std::size_t) { called = true; }));
+        CHECK(!called);
+    }
+
+    // extents merged at different times overlap, each run of them goes to one writer and is
+    // written in item order, so the later item wins as it did with a single writer
+    std::vector<MergerItem> overlapping;
+    for(uint64_t group = 0; group != 20; ++group) {
+        for(uint64_t k = 0; k != 10; ++k) {
+            uint64_t base = group * 10000 + k * 100;
+            overlapping.emplace_back(m_item{4 * (group * 10 + k), base}, source.data(), 300);
+        }
+    }
+    std::vector<char> expected(overlapping.back().getEnd(), 0);
+    for(const auto& item : overlapping) {
+        std::memcpy(expected.data() + item.getBaseOffset(),
+                reinterpret_cast<char*>(source.data()) + item.getLogItems().front().item.data_offset, item.getLength());
+    }
+    for(int writerCount : {2, 8, 64}) {
+        std::string targetFile = scratch.path + "/overlapping-" + std::to_string(writerCount);
+        Destager destager{targetFile, writerCount, {}};
+        std::vector<std::pair<std::size_t, std::size_t>> ranges;
+        CHECK(destager.destage(overlapping, [&ranges](std::size_t first, std::size_t last) {
+            ranges.emplace_back(first, last);
+        }));
+        CHECK(ranges.size() > 1);
+        for(const auto& range : ranges) {
+            CHECK(range.first % 10 == 0 && range.second % 10 == 0);
+        }
+        CHECK(readFile(targetFile) == expected);
+    }
+
+    // queued destages overlapping each other land in the order they were queued, whichever writers
+    // pick them up. Each write is reaped once and numbers count up as destages are written
+    for(int writerCount : {1, 8}) {
+        std::string targetFile = scratch.path + "/queued-" + std::to_string(writerCount);
+        Destager destager{targetFile, writerCount, {}};
+        std::size_t reaped = 0;
+        auto onWritten = [&reaped](const Destager::Write* first, const Destager::Write* last) { reaped += last - first; };
+        CHECK(destager.reap(onWritten, true) && reaped == 0);
+
+        std::vector<MergerItem> shifted;
+        const int rounds = 30;
+        for(int round = 0; round != rounds; ++round) {
+            // the same target offsets from a source a little further along each round
+            shifted.clear();
+            for(const auto& item : items) {
+                const auto& logItem = item.getLogItems().front();
+                shifted.emplace_back(m_item{logItem.item.data_offset + 4 * round, item.getBaseOffset()},
+                        source.data(), item.getLength());
+            }
+            CHECK(destager.submit(shifted.data(), shifted.data() + shifted.size()) == static_cast<uint64_t>(round + 1));
+        }
+        CHECK(destager.submit(shifted.data(), shifted.data()) == rounds);
+        CHECK(destager.drain(onWritten));
+        CHECK(destager.getCompletedDestage() == rounds);
+        CHECK(reaped == rounds * items.size());
+        CHECK(destager.sync());
+
+        std::vector<char> written = readFile(targetFile);
+        for(const auto& item : shifted) {
+            const auto& logItem = item.getLogItems().front();
+            CHECK(std::memcmp(written.data() + item.getBaseOffset(),
+                        reinterpret_cast<char*>(source.data()) + logItem.item.data_offset, item.getLength()) == 0);
+        }
+    }
+
+    // an unopenable target reports every item as done, so callers can release what they staged
+    Destager broken{scratch.path + "/missing/target", 2, {}};
+    CHECK(!broken.good());
+    std::size_t reported = 0;
+    CHECK(!broken.destage(items, [&reported](std::size_t first, std::size_t last) { reported += last - first; }));
+    CHECK(reported == items.size());
+}
+
+// a budget far below what the logs hold, producers waiting on capacity must always be let go,
+// also when the merge that raised backpressure left fewer chunks behind than the merge threshold.
+// The control blocks are only written when what they say changes
+static void checkBudget() {
+    ScratchDir scratch;
+    const int logCount = 2;
+    const uint64_t reqLen = 256;
+    const uint64_t requestCount = 1000;
+    TestLogs logs{scratch.path, logCount, reqLen};
+
+    MergeThread::SetMemoryBudget(20000);
+    MergeThread::SetDestageWriters(1, {});
+    MergeThread::StartMergeThread(scratch.path + "/target", logs.metadataFiles, logs.dataFiles, logs.outDataFile,
+            8, 100, 0);
+
+    // the merge thread has to be running for anything but the final flush to happen
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    bool released = true;
+    bool written = true;
+    for(uint64_t j = 0; j != requestCount && released && written; ++j) {
+        if(j % M_ITEM_COUNT == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            released = MergeThread::WaitForCapacity(5000);
+        }
+        for(int logNum = 0; logNum != logCount; ++logNum) {
+            written = written && logs.write(logNum, (j * logCount + logNum) * reqLen);
+        }
+    }
+    CHECK(released);
+    CHECK(written);
+
+    // once the merge thread has settled, the control blocks aren't written on every pass
+    uint64_t lastUsed = logs.control(0)->memory_used + 1;
+    for(int wait = 0; wait != 100 && logs.control(0)->memory_used != lastUsed; ++wait) {
+        lastUsed = logs.control(0)->memory_used;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    const uint64_t marker = 0x5eed;
+    logs.control(0)->memory_used = marker;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(logs.control(0)->memory_used == marker);
+
+    MergeThread::StopMergeThread();
+    MergeThread::SetMemoryBudget(0);
+    CHECK(!MergeThread::IsBackpressured());
+    for(int logNum = 0; logNum != logCount; ++logNum) CHECK(logs.control(logNum)->backpressure == 0);
+    CHECK(targetIsComplete(scratch.path + "/target", logCount * requestCount * reqLen));
+}
+
+// reservations across the wrap, release in any order, and getLargestFree always being the largest
+// reservation that succeeds
+static void checkStagingRing() {
+    StagingRing ring{1000};
+    uint64_t a = 1, b = 1, c = 1;
+    CHECK(ring.reserve(400, a) && a == 0);
+    CHECK(ring.reserve(400, b) && b == 400);
+    CHECK(ring.getLargestFree() == 200);
+    CHECK(!ring.reserve(300, c));
+
+    // the space at the end is too short, wrapping skips it
+    ring.release(a);
+    CHECK(ring.getUsed() == 400);
+    CHECK(ring.getLargestFree() == 400);
+    CHECK(ring.reserve(300, c) && c == 0);
+    CHECK(ring.getUsed() == 900);
+    CHECK(ring.getLargestFree() == 100);
+
+    // nothing comes back until the oldest reservation is released
+    ring.release(c);
+    CHECK(ring.getUsed() == 900);
+    ring.release(b);
+    CHECK(ring.getUsed() == 0);
+    CHECK(ring.getLargestFree() == 1000);
+
+    ring.setLimit(500);
+    CHECK(ring.getLimit() == 500);
+    CHECK(ring.getLargestFree() == 500);
+    CHECK(!ring.reserve(600, a));
+    CHECK(ring.reserve(500, a));
+    CHECK(ring.getLargestFree() == 0);
+    CHECK(!ring.reserve(1, b));
+    ring.release(a + 1);
+    CHECK(ring.getUsed() == 500);
+    ring.release(a);
+    ring.setLimit(5000);
+    CHECK(ring.getLimit() == ring.getCapacity());
+
+    // random reservations and releases against the live set
+    std::mt19937 random{26};
+    std::map<uint64_t, uint64_t> live;
+    for(int step = 0; step != 20000; ++step) {
+        if(step % 1000 == 0) ring.setLimit(400 + random() % 700);
+        if(!live.empty() && random() % 2 == 0) {
+            auto iter = live.begin();
+            std::advance(iter, random() % live.size());
+            ring.release(iter->first);
+            live.erase(iter);
+            continue;
+        }
+
+        uint64_t largest = ring.getLargestFree();
+        uint64_t offset;
+        CHECK(!ring.reserve(largest + 1, offset));
+        uint64_t length = largest == 0 ? 1 + random() % 300 : 1 + random() % largest;
+        bool reserved = ring.reserve(length, offset);
+        CHECK(reserved == (largest != 0));
+        if(!reserved) continue;
+
+        CHECK(offset + length <= ring.getCapacity());
+        auto next = live.lower_bound(offset);
+        CHECK(next == live.end() || offset + length <= next->first);
+        CHECK(next == live.begin() || std::prev(next)->first + std::prev(next)->second <= offset);
+        live.emplace(offset, length);
+        CHECK(ring.getUsed() <= ring.getLimit());
+    }
+    for(const auto& reservation : live) ring.release(reservation.first);
+    CHECK(ring.getUsed() == 0);
+
+    // staged through a ring limited to nothing, staging fails and the items are left as merged,
+    // rather than dropped or written from unreserved space
+    std::vector<int> source = patternBuffer(1024);
+    Merger merger{4};
+    merger.addItem(m_item{0, 0}, source.data(), 512, 1 << 30);
+    merger.addItem(m_item{1024, 1024}, source.data(), 512, 1 << 30);
+    std::vector<char> outData(1000);
+    ring.setLimit(0);
+    std::size_t destaged = 0;
+    CHECK(!StageMergedData(merger, outData.data(), ring, [&destaged](const MergerItem* first, const MergerItem* last) {
+        destaged += last - first;
+    }));
+    CHECK(destaged == 0);
+    CHECK(merger.getItemCount() == 2);
+    CHECK(merger.getDestagedCount() == 0);
+    CHECK(merger.getItems()[0].getBaseOffset() == 0 && merger.getItems()[1].getBaseOffset() == 1024);
+    CHECK(merger.getItems()[1].getLogItems().front().sourceData == source.data());
+    CHECK(ring.getUsed() == 0);
+}
+
+// a staging ring much smaller than the merge, early destages stream out in order from a cursor
+// and every byte of every item reaches the target exactly once, also with the writes in flight
+// while staging goes on
+static void checkEarlyDestage() {
+    const uint64_t targetSize = 1 << 20;
+    std::vector<int> source = patternBuffer(targetSize / sizeof(int));
+    char* sourceData = reinterpret_cast<char*>(source.data());
+
+    for(uint64_t capacity : {4096, 65536}) {
+        Merger merger{64};
+        uint64_t offset = 0;
+        uint64_t addedLength = 0;
+        for(int i = 0; offset < targetSize - 32768; ++i) {
+            uint64_t length = 4 * (1 + (i * 131) % 2500);
+            // runs of adjacent items merge, the gaps between them keep extents apart
+            if(i % 5 == 0) offset += 4 * (1 + i % 7);
+            merger.addItem(m_item{offset, offset}, sourceData, length, 1 << 30);
+            offset += length;
+            addedLength += length;
+        }
+        merger.mergeAll(1 << 30);
+
+        StagingRing staging{capacity};
+        std::vector<char> outData(capacity);
+        std::vector<char> target(targetSize, 0);
+        std::vector<char> writes(targetSize, 0);
+        bool ordered = true;
+        // items are staged into a new vector, so ranges are followed by target offset rather than address
+        std::size_t destagedItems = 0;
+        uint64_t destagedEnd = 0;
+        auto writeOut = [&](const MergerItem* first, const MergerItem* last) {
+            for(auto* item = first; item != last; ++item) {
+                uint64_t stagingOffset = item->getLogItems().front().item.data_offset;
+                std::memcpy(target.data() + item->getBaseOffset(), outData.data() + stagingOffset, item->getLength());
+                for(uint64_t byte = 0; byte != item->getLength(); ++byte) ++writes[item->getBaseOffset() + byte];
+                staging.release(stagingOffset);
+            }
+        };
+        uint64_t earlyDestages = 0;
+        CHECK(StageMergedData(merger, outData.data(), staging, [&](const MergerItem* first, const MergerItem* last) {
+            for(auto* item = first; item != last; ++item) {
+                if(item->getBaseOffset() < destagedEnd) ordered = false;
+                destagedEnd = item->getBaseOffset() + item->getLength();
+            }
+            destagedItems += last - first;
+            ++earlyDestages;
+            writeOut(first, last);
+        }));
+        CHECK(ordered);
+        CHECK(earlyDestages > 0);
+
+        const auto& items = merger.getItems();
+        CHECK(destagedItems == merger.getDestagedCount());
+        CHECK(destagedItems == 0 || items[destagedItems - 1].getEnd() == destagedEnd);
+        for(std::size_t i = 1; i < items.size(); ++i) CHECK(items[i - 1].getBaseOffset() < items[i].getBaseOffset());
+        writeOut(items.data() + merger.getDestagedCount(), items.data() + items.size());
+        CHECK(staging.getUsed() == 0);
+
+        bool once = true;
+        for(uint64_t byte = 0; byte != targetSize; ++byte) {
+            if(writes[byte] > 1 || (writes[byte] == 1 && target[byte] != sourceData[byte])) once = false;
+        }
+        CHECK(once);
+        uint64_t written = 0;
+        for(char count : writes) written += count;
+        CHECK(written == addedLength);
+    }
+
+    // the same through a destager, early destages are queued and staging goes on as soon as
+    // some of their ranges are written, while the rest are still in flight
+    ScratchDir scratch;
+    Merger merger{64};
+    for(uint64_t offset = 0, i = 0; offset < targetSize - 32768; ++i) {
+        uint64_t length = 4 * (1 + (i * 131) % 2500);
+        if(i % 5 == 0) offset += 4 * (1 + i % 7);
+        merger.addItem(m_item{offset, offset}, sourceData, length, 1 << 30);
+        offset += length;
+    }
+    merger.mergeAll(1 << 30);
+    std::vector<MergerItem> added = merger.getItems();
+
+    StagingRing staging{8192};
+    std::vector<char> outData(8192);
+    Destager destager{scratch.path + "/target", 4, {}};
+    auto release = [&](const Destager::Write* first, const Destager::Write* last) {
+        for(auto* write = first; write != last; ++write) staging.release(write->source - outData.data());
+    };
+    CHECK(StageMergedData(merger, outData.data(), staging, [&](const MergerItem* first, const MergerItem* last) {
+        destager.submit(first, last);
+        CHECK(destager.reap(release, true));
+    }));
+    const auto& items = merger.getItems();
+    destager.submit(items.data() + merger.getDestagedCount(), items.data() + items.size());
+    CHECK(destager.drain(release));
+    CHECK(staging.getUsed() == 0);
+
+    std::vector<char> target = readFile(scratch.path + "/target");
+    for(const auto& item : added) {
+        CHECK(item.getEnd() <= target.size() &&
+                std::memcmp(target.data() + item.getBaseOffset(), sourceData + item.getBaseOffset(), item.getLength()) == 0);
+    }
+}
+
+// a requested or periodic sync covers what the master merger still holds, not only what was destaged,
+// and the merged chunks are handed back once it's done, or once the producers would run out of them
+static void checkSync() {
+    using MergeThread::DurabilityPolicy;
+    const int logCount = 2;
+    const uint64_t reqLen = 256;
+    const uint64_t requestCount = 8 * M_ITEM_COUNT;
+
+    for(auto policy : {DurabilityPolicy::OnRequest, DurabilityPolicy::None, DurabilityPolicy::Periodic}) {
+        ScratchDir scratch;
+        TestLogs logs{scratch.path, logCount, reqLen};
+        std::string target = scratch.path + "/target";
+
+        // merge every full chunk right away, and keep it all in the master merger
+        MergeThread::SetDurabilityPolicy(policy, 20);
+        MergeThread::StartMergeThread(target, logs.metadataFiles, logs.dataFiles, logs.outDataFile, 0, 1 << 20, 0);
+        for(uint64_t j = 0; j != requestCount; ++j) {
+            for(int logNum = 0; logNum != logCount; ++logNum) logs.write(logNum, (j * logCount + logNum) * reqLen);
+        }
+
+        auto synced = [&logs]() {
+            auto stats = MergeThread::GetMergeStats();
+            if(stats.mergeCount == 0 || stats.durableMergeCount != stats.mergeCount) return false;
+            for(auto* chunks : logs.metadata) {
+                for(int i = 0; i != M_CHUNK_COUNT; ++i) {
+                    if(!chunks[i].free) return false;
+                }
+            }
+            return true;
+        };
+        // let the chunks be merged before asking, so the request has something in the master merger to cover
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if(policy != DurabilityPolicy::Periodic) MergeThread::RequestSync();
+        auto start = std::chrono::steady_clock::now();
+        while(!synced() && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        CHECK(synced());
+        CHECK(targetIsComplete(target, logCount * requestCount * reqLen));
+
+        MergeThread::StopMergeThread();
+        MergeThread::SetDurabilityPolicy(DurabilityPolicy::None, 0);
+    }
+
+    // a byte count the rings can't hold before it's reached, or nothing but requests, and nobody
+    // requesting. The producer still gets its chunks back once they'd run out
+    for(auto policy : {DurabilityPolicy::EveryNBytes, DurabilityPolicy::OnRequest}) {
+        ScratchDir scratch;
+        const uint64_t smallReqLen = 16;
+        const uint64_t manyRequests = 2 * M_CHUNK_COUNT * M_ITEM_COUNT;
+        TestLogs logs{scratch.path, 1, smallReqLen};
+        std::string target = scratch.path + "/target";
+
+        MergeThread::SetDurabilityPolicy(policy, 1ull << 40);
+        MergeThread::StartMergeThread(target, logs.metadataFiles, logs.dataFiles, logs.outDataFile, 8, 1 << 20, 0);
+        bool written = true;
+        for(uint64_t j = 0; j != manyRequests && written; ++j) written = logs.write(0, j * smallReqLen);
+        CHECK(written);
+
+        MergeThread::StopMergeThread();
+        MergeThread::SetDurabilityPolicy(DurabilityPolicy::None, 0);
+        CHECK(targetIsComplete(target, manyRequests * smallReqLen));
+    }
+}
+
+// a flush covers every chunk that isn't full yet, including ones handed over partly filled,
+// and no ticket is left that nothing will complete
+static void checkFlush() {
+    const int logCount = 2;
+    const uint64_t reqLen = 256;
+
+    CHECK(MergeThread::FlushAsync() == 0);
+    CHECK(!MergeThread::FlushWait(0, -1));
+    CHECK(!MergeThread::FlushPoll(0));
+
+    for(auto policy : {MergeThread::DurabilityPolicy::None, MergeThread::DurabilityPolicy::OnRequest}) {
+        ScratchDir scratch;
+        TestLogs logs{scratch.path, logCount, reqLen};
+        std::string target = scratch.path + "/target";
+        MergeThread::SetDurabilityPolicy(policy, 0);
+        // nothing is merged until a flush asks for it
+        MergeThread::StartMergeThread(target, logs.metadataFiles, logs.dataFiles, logs.outDataFile,
+                M_CHUNK_COUNT, 1 << 20, 0);
+
+        uint64_t j = 0;
+        uint64_t lastTicket = 0;
+        for(uint64_t phaseEnd : {37, 90, 200}) {
+            for(; j != phaseEnd; ++j) {
+                for(int logNum = 0; logNum != logCount; ++logNum) {
+                    logs.write(logNum, (j * logCount + logNum) * reqLen);
+                    // hand a chunk over before it's full now and then, the ones after it are flushed as well
+                    if(j % 23 == 5) logs.nextChunk(logNum);
+                }
+            }
+            uint64_t ticket = MergeThread::FlushAsync();
+            CHECK(ticket > lastTicket);
+            CHECK(MergeThread::FlushWait(ticket, 5000));
+            if(lastTicket != 0) CHECK(MergeThread::FlushPoll(lastTicket));
+            CHECK(targetIsComplete(target, j * logCount * reqLen));
+            lastTicket = ticket;
+        }
+
+        MergeThread::StopMergeThread();
+        MergeThread::SetDurabilityPolicy(MergeThread::DurabilityPolicy::None, 0);
+        CHECK(MergeThread::FlushAsync() == 0);
+        CHECK(targetIsComplete(target, j * logCount * reqLen));
+    }
+
+    // a merge thread that gives up at startup still completes whatever ticket it handed out
+    ScratchDir scratch;
+    TestLogs logs{scratch.path, 1, reqLen};
+    CHECK(truncate(logs.dataFiles[0].c_str(), logs.dataSize / 2) == 0);
+    MergeThread::StartMergeThread(scratch.path + "/target", logs.metadataFiles, logs.dataFiles, logs.outDataFile,
+            4, 100, 0);
+    uint64_t ticket = MergeThread::FlushAsync();
+    CHECK(ticket == 0 || MergeThread::FlushWait(ticket, 5000));
+    auto start = std::chrono::steady_clock::now();
+    while(MergeThread::FlushAsync() != 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(MergeThread::FlushAsync() == 0);
+    MergeThread::StopMergeThread();
+}
+
+// symlinked logs are listed like any other, and the mapper skips empty rings and refuses short data logs
+static void checkLogMapper() {
+    ScratchDir scratch;
+    std::string folder = scratch.path + "/buffer";
+    std::string elsewhere = scratch.path + "/elsewhere";
+    std::filesystem::create_directories(folder + "/subfolder");
+    std::filesystem::create_directories(elsewhere);
+    const uint64_t reqLen = 256;
+    {
+        TestLogs logs{folder, 2, reqLen};
+        for(uint64_t j = 0; j != 3; ++j) logs.write(0, j * reqLen);
+        std::filesystem::remove(logs.outDataFile);
+    }
+    {
+        TestLogs linked{elsewhere, 1, reqLen};
+        linked.write(0, 0);
+    }
+    std::filesystem::create_symlink(elsewhere + "/metadata-log0", folder + "/metadata-log2");
+    std::filesystem::create_symlink(elsewhere + "/data-log0", folder + "/data-log2");
+    std::filesystem::create_symlink(elsewhere + "/missing", folder + "/data-log9");
+    std::filesystem::create_directory_symlink(elsewhere, folder + "/metadata-log9");
+
+    int dirFd = open(folder.c_str(), O_RDONLY | O_DIRECTORY);
+    std::vector<std::string> filenames;
+    CHECK(ListRegularFiles(dirFd, filenames));
+    close(dirFd);
+    std::sort(filenames.begin(), filenames.end());
+    CHECK((filenames == std::vector<std::string>{"data-log0", "data-log1", "data-log2",
+                "metadata-log0", "metadata-log1", "metadata-log2"}));
+
+    // a data log cut short after the listing
+    std::filesystem::copy_file(folder + "/metadata-log0", folder + "/metadata-log3");
+    std::filesystem::copy_file(folder + "/data-log0", folder + "/data-log3");
+    uint64_t dataSize = M_CHUNK_COUNT * sizeof(m_chunk);
+    CHECK(truncate((folder + "/data-log3").c_str(), dataSize / 2) == 0);
+
+    LogMapper mapper{3, folder, false, true};
+    for(int logNum = 0; logNum != 4; ++logNum) {
+        std::string suffix = "-log" + std::to_string(logNum);
+        mapper.add("metadata" + suffix, "data" + suffix, M_METADATA_SIZE, dataSize);
+    }
+    CHECK(mapper.getLogCount() == 4);
+    const MappedLog& live = mapper.get(0);
+    CHECK(live.ok && live.live && live.data != nullptr);
+    CHECK(live.metadata != nullptr && live.metadata[0].item_count == 3);
+    const MappedLog& empty = mapper.get(1);
+    CHECK(empty.ok && !empty.live && empty.data == nullptr);
+    const MappedLog& linked = mapper.get(2);
+    CHECK(linked.ok && linked.live && linked.metadata[0].item_count == 1);
+    const MappedLog& cut = mapper.get(3);
+    CHECK(!cut.ok);
+    CHECK(std::filesystem::file_size(folder + "/data-log3") == dataSize / 2);
+    for(int logNum = 0; logNum != 4; ++logNum) mapper.release(logNum);
+
+    // metadata short of the control block only grows where that's asked for
+    CHECK(truncate((folder + "/metadata-log1").c_str(), M_CHUNK_COUNT * sizeof(m_chunk)) == 0);
+    LogMapper strict{1, folder, false, false};
+    strict.add("metadata-log1", "data-log1", M_METADATA_SIZE, dataSize);
+    CHECK(!strict.get(0).ok);
+    LogMapper growing{1, folder, true, false};
+    growing.add("metadata-log1", "data-log1", M_METADATA_SIZE, dataSize);
+    CHECK(growing.get(0).ok);
+    CHECK(std::filesystem::file_size(folder + "/metadata-log1") == M_METADATA_SIZE);
+}
+
+static uint64_t allocatedBytes(int fd) {
+    struct stat fileStat;
+    return fstat(fd, &fileStat) == 0 ? fileStat.st_blocks * 512 : 0;
+}
+
+// covered ranges coalesce, Extents allocates only them and Full everything up to their end,
+// holes are punched between them without changing the size, and the merge thread can merge
+// into an existing target without truncating it
+static void checkTargetFile() {
+    ScratchDir scratch;
+    const uint64_t megabyte = 1 << 20;
+
+    std::vector<int> source = patternBuffer(1024);
+    std::vector<MergerItem> items;
+    for(auto range : std::vector<TargetRange>{{0, 100}, {100, 50}, {140, 60}, {300, 10}, {megabyte, 4096}}) {
+        items.emplace_back(m_item{0, range.offset}, source.data(), range.length);
+    }
+    std::vector<TargetRange> covered = CoveredRanges(items.data(), items.data() + items.size());
+    CHECK(covered.size() == 3);
+    CHECK(covered.size() == 3 && covered[0].offset == 0 && covered[0].length == 200);
+    CHECK(covered.size() == 3 && covered[1].offset == 300 && covered[1].length == 10);
+    CHECK(covered.size() == 3 && covered[2].offset == megabyte && covered[2].length == 4096);
+
+    std::vector<TargetRange> ranges{{0, 4096}, {megabyte, 4096}};
+    int extents = open((scratch.path + "/extents").c_str(), O_RDWR | O_CREAT, 0666);
+    int full = open((scratch.path + "/full").c_str(), O_RDWR | O_CREAT, 0666);
+    if(!PreallocateTarget(extents, ranges, Preallocation::Extents)) {
+        std::cout << "targetFile: fallocate isn't supported here, skipping the layout checks\n";
+    }
+    else {
+        CHECK(allocatedBytes(extents) >= 2 * 4096 && allocatedBytes(extents) < megabyte);
+        CHECK(PreallocateTarget(full, ranges, Preallocation::Full));
+        CHECK(allocatedBytes(full) >= megabyte + 4096);
+        CHECK(std::filesystem::file_size(scratch.path + "/full") == megabyte + 4096);
+        // from the end of what an earlier destage allocated
+        CHECK(PreallocateTarget(extents, {{2 * megabyte, 4096}}, Preallocation::Full, megabyte + 4096));
+        CHECK(allocatedBytes(extents) >= megabyte && allocatedBytes(extents) < 2 * megabyte);
+        CHECK(PreallocateTarget(full, ranges, Preallocation::Full, 2 * megabyte));
+
+        std::vector<char> filler(megabyte + 4096, 'x');
+        CHECK(WriteTarget(full, filler.data(), filler.size(), 0));
+        CHECK(PunchGaps(full, ranges));
+        CHECK(allocatedBytes(full) < megabyte);
+        std::vector<char> punched = readFile(scratch.path + "/full");
+        CHECK(punched.size() == filler.size());
+        CHECK(punched.size() == filler.size() && punched[0] == 'x' && punched[4095] == 'x' &&
+                punched[4096] == 0 && punched[megabyte - 1] == 0 && punched[megabyte] == 'x' && punched.back() == 'x');
+    }
+    close(extents);
+    close(full);
+
+    // merging into a target twice the size, only the merged extents change
+    const uint64_t reqLen = 256;
+    const uint64_t requestCount = 3 * M_ITEM_COUNT;
+    TestLogs logs{scratch.path, 1, reqLen};
+    for(uint64_t j = 0; j != requestCount; ++j) logs.write(0, j * reqLen);
+    std::string target = scratch.path + "/target";
+    std::vector<char> existing(2 * requestCount * reqLen, 'x');
+    int existingFd = open(target.c_str(), O_WRONLY | O_CREAT, 0666);
+    CHECK(WriteTarget(existingFd, existing.data(), existing.size(), 0));
+    close(existingFd);
+
+    MergeThread::SetTruncateTarget(false);
+    MergeThread::SetTargetPreallocation(MergeThread::TargetPreallocation::Full);
+    MergeThread::StartMergeThread(target, logs.metadataFiles, logs.dataFiles, logs.outDataFile, 0, 100, 0);
+    MergeThread::StopMergeThread();
+    MergeThread::SetTruncateTarget(true);
+    MergeThread::SetTargetPreallocation(MergeThread::TargetPreallocation::None);
+
+    std::vector<char> merged = readFile(target);
+    CHECK(merged.size() == existing.size());
+    uint64_t mergedSize = requestCount * reqLen;
+    CHECK(merged.size() == existing.size() &&
+            std::equal(merged.begin() + mergedSize, merged.end(), existing.begin() + mergedSize));
+    std::filesystem::resize_file(target, mergedSize);
+    CHECK(targetIsComplete(target, mergedSize));
+}
+
+// gathered copies match memcpy for every kernel this machine runs, at odd offsets and lengths,
+// over contiguous runs and on either side of the streaming threshold
+static void checkCopyEngine() {
+    std::mt19937 random{7};
+    std::vector<char> source(1 << 20);
+    for(auto& byte : source) byte = static_cast<char>(random());
+
+    // source offset and length of each segment
+    const std::vector<std::vector<std::pair<uint64_t, uint64_t>>> cases{
+        {{3, 1}, {101, 17}, {118, 45}, {7000, 333}},
+        {{1, 5}, {9, 3}, {12, 2}},
+        {{5, 70001}, {70006, 3}, {200001, 1}, {300007, 40000}, {340007, 4097}},
+        {{11, 1}, {500003, 131071}},
+        {{0, 65536}}
+    };
+
+    // null is whatever this machine picks by default
+    for(const char* name : {static_cast<const char*>(nullptr), "avx512", "avx2", "sse2"}) {
+        if(!SelectCopyEngine(name)) {
+            std::cout << "copyEngine: " << name << " isn't supported here, skipping\n";
+            continue;
+        }
+        CHECK(name == nullptr || std::strcmp(CopyEngineName(), name) == 0);
+
+        for(const auto& pieces : cases) {
+            std::vector<CopySegment> segments;
+            std::vector<char> expected;
+            for(auto piece : pieces) {
+                segments.push_back(CopySegment{source.data() + piece.first, piece.second});
+                expected.insert(expected.end(), source.begin() + piece.first,
+                        source.begin() + piece.first + piece.second);
+            }
+            for(uint64_t destinationOffset : {0, 1, 13, 63}) {
+                std::vector<char> destination(expected.size() + 128, 'g');
+                CopyGather(destination.data() + destinationOffset, segments.data(), segments.size());
+                CHECK(std::equal(expected.begin(), expected.end(), destination.begin() + destinationOffset));
+                CHECK(std::all_of(destination.begin(), destination.begin() + destinationOffset,
+                            [](char byte) { return byte == 'g'; }));
+                CHECK(std::all_of(destination.begin() + destinationOffset + expected.size(), destination.end(),
+                            [](char byte) { return byte == 'g'; }));
+            }
+        }
+    }
+    CHECK(SelectCopyEngine(nullptr));
+    CHECK(!SelectCopyEngine("neon"));
+}
+
+// metadata logs from before the control block are grown to take it, a short data log stops the merge thread
+static void checkShortLogs() {
+    ScratchDir scratch;
+    const uint64_t reqLen = 256;
+    TestLogs logs{scratch.path, 1, reqLen};
+    for(uint64_t j = 0; j != M_ITEM_COUNT; ++j) logs.write(0, j * reqLen);
+
+    CHECK(truncate(logs.metadataFiles[0].c_str(), M_CHUNK_COUNT * sizeof(m_chunk)) == 0);
+    MergeThread::StartMergeThread(scratch.path + "/target", logs.metadataFiles, logs.dataFiles, logs.outDataFile,
+            4, 100, 0);
+    MergeThread::StopMergeThread();
+    CHECK(std::filesystem::file_size(logs.metadataFiles[0]) == M_METADATA_SIZE);
+    CHECK(targetIsComplete(scratch.path + "/target", M_ITEM_COUNT * reqLen));
+
+    uint64_t shortSize = logs.dataSize / 2;
+    CHECK(truncate(logs.dataFiles[0].c_str(), shortSize) == 0);
+    MergeThread::StartMergeThread(scratch.path + "/short-target", logs.metadataFiles, logs.dataFiles,
+            logs.outDataFile, 4, 100, 0);
+    MergeThread::StopMergeThread();
+    CHECK(std::filesystem::file_size(logs.dataFiles[0]) == shortSize);
+    CHECK(!std::filesystem::exists(scratch.path + "/short-target"));
+}
+
+// the fixed policy keeps the old thresholds, the adaptive one follows idle time, fill rate and merge ratio
+static void checkMergePolicy() {
+    using std::chrono::milliseconds;
+    auto start = std::chrono::steady_clock::now();
+    auto merge = [&](MergePolicy& policy, int ms, std::vector<int> used, std::vector<int> free,
+            std::vector<uint64_t> filled) {
+        return policy.shouldMerge(MergeObservation{start + milliseconds(ms), used, free, filled});
+    };
+    auto destage = [&](MergePolicy& policy, int ms, uint64_t staged, std::size_t masterItems) {
+        return policy.shouldDestage(DestageObservation{start + milliseconds(ms), staged, 800, masterItems});
+    };
+
+    FixedMergePolicy fixed{8, 100};
+    CHECK(merge(fixed, 0, {8, 0}, {1016, 1024}, {8, 0}) == TriggerReason::None);
+    CHECK(merge(fixed, 0, {8, 9}, {1016, 1015}, {8, 9}) == TriggerReason::Threshold);
+    CHECK(destage(fixed, 0, 699, 100) == TriggerReason::None);
+    CHECK(destage(fixed, 0, 700, 0) == TriggerReason::Threshold);
+    CHECK(destage(fixed, 0, 0, 101) == TriggerReason::Threshold);
+
+    AdaptiveMergePolicy adaptive{8, 100, milliseconds(5)};
+    CHECK(merge(adaptive, 0, {0}, {M_CHUNK_COUNT}, {0}) == TriggerReason::None);
+    CHECK(merge(adaptive, 1, {4}, {M_CHUNK_COUNT - 4}, {4}) == TriggerReason::None);
+    CHECK(merge(adaptive, 2, {9}, {M_CHUNK_COUNT - 9}, {9}) == TriggerReason::Threshold);
+
+    // a merge that coalesces better than the last one doubles the threshold, up to half the ring
+    adaptive.mergeDone(TriggerReason::Threshold, 100, 50, std::chrono::microseconds(1));
+    CHECK(adaptive.getThreshold() == 8);
+    adaptive.mergeDone(TriggerReason::Threshold, 100, 40, std::chrono::microseconds(1));
+    CHECK(adaptive.getThreshold() == 16);
+    CHECK(merge(adaptive, 3, {12}, {M_CHUNK_COUNT - 12}, {12}) == TriggerReason::Deferred);
+    for(uint64_t itemsOut : {36, 32, 28, 25, 22, 19, 17, 15, 13, 11}) {
+        adaptive.mergeDone(TriggerReason::Threshold, 100, itemsOut, std::chrono::microseconds(1));
+    }
+    CHECK(adaptive.getThreshold() == M_CHUNK_COUNT / 2);
+    adaptive.mergeDone(TriggerReason::Threshold, 100, 30, std::chrono::microseconds(1));
+    CHECK(adaptive.getThreshold() == M_CHUNK_COUNT / 4);
+    // only threshold merges move it
+    adaptive.mergeDone(TriggerReason::Idle, 100, 1, std::chrono::microseconds(1));
+    CHECK(adaptive.getThreshold() == M_CHUNK_COUNT / 4);
+    adaptive.mergeDone(TriggerReason::Threshold, 100, 30, std::chrono::microseconds(1));
+    CHECK(adaptive.getThreshold() == M_CHUNK_COUNT / 4);
+
+    // nothing new filled since 3ms
+    CHECK(merge(adaptive, 6, {12}, {M_CHUNK_COUNT - 12}, {12}) == TriggerReason::Deferred);
+    CHECK(destage(adaptive, 6, 0, 1) == TriggerReason::None);
+    CHECK(merge(adaptive, 9, {12}, {M_CHUNK_COUNT - 12}, {12}) == TriggerReason::Idle);
+    CHECK(destage(adaptive, 9, 0, 1) == TriggerReason::Idle);
+    CHECK(destage(adaptive, 9, 0, 0) == TriggerReason::None);
+    CHECK(merge(adaptive, 9, {0}, {M_CHUNK_COUNT}, {12}) == TriggerReason::None);
+    CHECK(merge(adaptive, 9, {1}, {M_CHUNK_COUNT / 16}, {12}) == TriggerReason::Overflow);
+
+    // 500 chunks a millisecond leaves 4ms on the ring, under four 2ms merges
+    AdaptiveMergePolicy filling{8, 100, milliseconds(5)};
+    CHECK(merge(filling, 0, {0}, {M_CHUNK_COUNT}, {0}) == TriggerReason::None);
+    filling.mergeDone(TriggerReason::Threshold, 100, 50, milliseconds(2));
+    CHECK(merge(filling, 1, {1}, {500}, {500}) == TriggerReason::Overflow);
+}
+
+// fills a buffer folder with logs for smartMerge, which frees every chunk it merges, so each run needs fresh ones.
+// Returns the size of the merged target. With a spacing each log writes its own run of requests that far apart
+static uint64_t fillBufferFolder(const std::string& folder, int logCount, uint64_t requestCount, uint64_t reqLen,
+        uint64_t spacing = 0) {
+    std::filesystem::create_directories(folder);
+    TestLogs logs{folder, logCount, reqLen};
+    std::filesystem::remove(logs.outDataFile);
+    for(uint64_t j = 0; j != requestCount; ++j) {
+        for(int logNum = 0; logNum != logCount; ++logNum) {
+            logs.write(logNum, spacing != 0 ? logNum * spacing + j * reqLen : (j * logCount + logNum) * reqLen);
+        }
+    }
+    return spacing != 0 ? (logCount - 1) * spacing + requestCount * reqLen : logCount * requestCount * reqLen;
+}
+
+static bool runSmartMerge(const std::string& arguments) {
+    std::string command = "\"" + smartMergePath + "\" " + arguments + " > /dev/null";
+    return std::system(command.c_str()) == 0;
+}
+
+// a cascade writes the same target as a single pass, and keeps its intermediate outputs
+// out of the buffer folder's listing even when the target is written into the buffer folder.
+// Indexes left behind without their data don't take the merge down, and a full preallocation
+// is left to the target
+static void checkCascade() {
+    CHECK(!smartMergePath.empty());
+    if(smartMergePath.empty()) return;
+
+    ScratchDir scratch;
+    const int logCount = 7;
+    const uint64_t requestCount = 150;
+    const uint64_t reqLen = 256;
+    std::string logs = scratch.path + "/logs";
+    std::string outData = " --outDataFile " + scratch.path + "/out-data";
+
+    uint64_t size = fillBufferFolder(logs, logCount, requestCount, reqLen);
+    CHECK(runSmartMerge("--bufferFolder " + logs + outData + " --outFile " + scratch.path + "/single"));
+    CHECK(targetIsComplete(scratch.path + "/single", size));
+
+    fillBufferFolder(logs, logCount, requestCount, reqLen);
+    CHECK(runSmartMerge("--bufferFolder " + logs + outData + " --outFile " + logs + "/cascaded --fanIn 2 --keepIntermediate"));
+    CHECK(targetIsComplete(logs + "/cascaded", size));
+    CHECK(std::filesystem::is_directory(logs + "/cascaded.cascade") && !std::filesystem::is_empty(logs + "/cascaded.cascade"));
+    CHECK(readFile(scratch.path + "/single") == readFile(logs + "/cascaded"));
+
+    // the kept intermediates sit right next to fresh logs that cover less, only the logs may be merged
+    size = fillBufferFolder(logs, logCount, requestCount / 3, reqLen);
+    CHECK(runSmartMerge("--bufferFolder " + logs + outData + " --outFile " + logs + "/again --fanIn 3"));
+    CHECK(targetIsComplete(logs + "/again", size));
+    CHECK(!std::filesystem::exists(logs + "/again.cascade"));
+
+    // an index whose data is gone or cut short is skipped, its data is never read past the end of the file
+    std::string keptIndex = logs + "/cascaded.cascade/L0.0.merged-index";
+    std::filesystem::copy_file(keptIndex, logs + "/missing.merged-index");
+    std::filesystem::copy_file(keptIndex, logs + "/short.merged-index");
+    std::filesystem::copy_file(logs + "/cascaded.cascade/L0.0", logs + "/short");
+    std::filesystem::resize_file(logs + "/short", reqLen);
+    size = fillBufferFolder(logs, logCount, requestCount / 3, reqLen);
+    CHECK(runSmartMerge("--bufferFolder " + logs + outData + " --outFile " + scratch.path + "/skipped"));
+    CHECK(targetIsComplete(scratch.path + "/skipped", size));
+
+    // --preallocate full lays out the target from offset 0, the intermediates only get their own extents
+    const uint64_t spacing = 64ull << 20;
+    std::string spread = scratch.path + "/spread";
+    size = fillBufferFolder(spread, 4, requestCount, reqLen, spacing);
+    CHECK(runSmartMerge("--bufferFolder " + spread + outData + " --outFile " + scratch.path + "/spread-out" +
+                " --fanIn 2 --preallocate full --keepIntermediate"));
+    auto allocated = [](const std::string& filename) {
+        struct stat fileStat;
+        return stat(filename.c_str(), &fileStat) == 0 ? static_cast<uint64_t>(fileStat.st_blocks) * 512 : 0;
+    };
+    CHECK(allocated(scratch.path + "/spread-out") >= size - spacing);
+    for(int i = 0; i != 2; ++i) {
+        std::string stageFile = scratch.path + "/spread-out.cascade/L0." + std::to_string(i);
+        CHECK(std::filesystem::exists(stageFile) && allocated(stageFile) < spacing / 8);
+    }
+}
+
+// a trace captured while a producer fills its ring a few items at a time only carries the new items
+// of a chunk captured part way, and replays into the target the producer wrote. A replay that
+// destages early from one big merge counts only the destages that wrote something
+static void checkTrace() {
+    CHECK(!captureLogsPath.empty() && !replayMergePath.empty());
+    if(captureLogsPath.empty() || replayMergePath.empty()) return;
+
+    ScratchDir scratch;
+    const uint64_t reqLen = 512;
+    // more than the merge thread stages at once, but within the data log so nothing is overwritten
+    const uint64_t requestCount = 32 * M_ITEM_COUNT + 5;
+    TestLogs logs{scratch.path, 1, reqLen};
+    std::string traceFile = scratch.path + "/trace";
+
+    bool captured = false;
+    std::thread capture([&]() {
+        std::string command = "\"" + captureLogsPath + "\" --traceFile " + traceFile +
+            " --metadataFiles " + logs.metadataFiles[0] + " --dataFiles " + logs.dataFiles[0] +
+            " --captureData --intervalUs 500 --duration 1 > /dev/null";
+        captured = std::system(command.c_str()) == 0;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    for(uint64_t j = 0; j != requestCount; ++j) {
+        CHECK(logs.write(0, j * reqLen));
+        // the first few chunks fill slowly enough to be captured part way
+        if(j < 3 * M_ITEM_COUNT && j % 5 == 4) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    capture.join();
+    CHECK(captured);
+
+    std::ifstream trace{traceFile, std::ios::binary};
+    m_trace_header header{};
+    trace.read(reinterpret_cast<char*>(&header), sizeof(header));
+    CHECK(header.magic == M_TRACE_MAGIC && header.version == M_TRACE_VERSION);
+    CHECK(header.log_count == 1 && (header.flags & M_TRACE_FLAG_DATA) && header.data_log_size == logs.dataSize);
+
+    std::vector<uint32_t> recordedItems(M_CHUNK_COUNT, 0);
+    uint64_t itemCount = 0;
+    bool continued = false;
+    bool consistent = true;
+    bool dataMatches = true;
+    std::vector<char> itemData(reqLen);
+    m_trace_record record{};
+    while(trace.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        CHECK(record.log == 0 && record.chunk_index < M_CHUNK_COUNT && record.chunk.item_count <= M_ITEM_COUNT);
+        if(record.log != 0 || record.chunk_index >= M_CHUNK_COUNT || record.chunk.item_count > M_ITEM_COUNT) break;
+
+        uint32_t& recorded = recordedItems[record.chunk_index];
+        // a chunk seen before only adds the items after the ones already recorded
+        consistent = consistent && record.first_item == (record.new_chunk ? 0 : recorded);
+        continued = continued || record.first_item != 0;
+        for(uint32_t itemNum = record.first_item; itemNum < record.chunk.item_count; ++itemNum) {
+            trace.read(itemData.data(), itemData.size());
+            const int* values = reinterpret_cast<const int*>(itemData.data());
+            uint64_t target = record.chunk.items[itemNum].target_offset;
+            for(uint64_t i = 0; i != reqLen / sizeof(int); ++i) {
+                dataMatches = dataMatches && values[i] == static_cast<int>(target / sizeof(int) + i);
+            }
+            ++itemCount;
+        }
+        recorded = record.chunk.item_count;
+    }
+    CHECK(consistent);
+    CHECK(continued);
+    CHECK(dataMatches);
+    CHECK(itemCount == requestCount);
+
+    std::string workDir = scratch.path + "/replay";
+    std::filesystem::create_directories(workDir);
+    std::string report = scratch.path + "/report";
+    std::string command = "\"" + replayMergePath + "\" --traceFile " + traceFile + " --workDir " + workDir +
+        " --asFastAsPossible > " + report;
+    CHECK(std::system(command.c_str()) == 0);
+    CHECK(targetIsComplete(workDir + "/replay-target", requestCount * reqLen));
+
+    std::ifstream reportIn{report};
+    unsigned long long merges = 0;
+    unsigned long long destages = 0;
+    for(std::string line; std::getline(reportIn, line);) {
+        if(line.rfind("merges: ", 0) == 0) std::sscanf(line.c_str(), "merges: %llu, destages: %llu", &merges, &destages);
+    }
+    CHECK(merges != 0);
+    CHECK(destages != 0 && destages <= merges);
+}
+
+/*
+ * Behavioural checks of the merge components, in the spirit of the other tools here.
+ * Each check is named on the command line (all of them if none are), ctest runs them one at a time.
+ * The cascade check needs --smartMerge <path to smartMerge>, the trace check
+ * --captureLogs <path to captureLogs> and --replayMerge <path to replayMerge>.
+ * Exits nonzero if any check failed.
+ */
+int main(int argc, char** argv) {
+    const std::map<std::string, std::function<void()>> checks{
+        {"budget", checkBudget},
+        {"cascade", checkCascade},
+        {"copyEngine", checkCopyEngine},
+        {"destager", checkDestager},
+        {"earlyDestage", checkEarlyDestage},
+        {"flush", checkFlush},
+        {"logMapper", checkLogMapper},
+        {"mergePolicy", checkMergePolicy},
+        {"shortLogs", checkShortLogs},
+        {"stagingRing", checkStagingRing},
+        {"sync", checkSync},
+        {"targetFile", checkTargetFile},
+        {"trace", checkTrace},
+    };
+
+    std::vector<std::string> selected;
+    std::string activeFlag = "";
+    for(int argNum = 1; argNum < argc; ++argNum) {
+        std::string currArg{argv[argNum]};
+        if(currArg[0] == '-') activeFlag = currArg;
+        else if(activeFlag == "--smartMerge") {
+            smartMergePath = std::move(currArg);
+            activeFlag = "";
+        }
+        else if(activeFlag == "--captureLogs") {
+            captureLogsPath = std::move(currArg);
+            activeFlag = "";
+        }
+        else if(activeFlag == "--replayMerge") {
+            replayMergePath = std::move(currArg);
+            activeFlag = "";
+        }
+        else selected.push_back(std::move(currArg));
+    }
+    if(selected.empty()) {
+        for(const auto& check : checks) selected.push_back(check.first);
+    }
+
+    for(const auto& name : selected) {
+        auto check = checks.find(name);
+        if(check == checks.end()) {
+            std::cerr << "Unknown check \"" << name << "\"\n";
+            return 2;
+        }
+        int failuresBefore = failures;
+        check->second();
+        std::cout << name << ": " << (failures == failuresBefore ? "ok" : "FAILED") << '\n';
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+#include <cstring>
+
+#include "copyEngine.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define COPY_ENGINE_X86 1
+#endif
+
+// a gathered copy at least this large would only push the merge metadata out of the cache,
+// the staged data isn't read again until the destager writes it out
+static const uint64_t streamingThreshold = 64 * 1024;
+// cache lines of the next segment to prefetch
+static const int prefetchLines = 4;
+static const uintptr_t cacheLine = 64;
+
+#ifdef COPY_ENGINE_X86
+
+// each copies length bytes to a destination aligned to the vector size, length a multiple of it
+
+static void streamSse2(char* destination, const char* source, uint64_t length) {
+    for(uint64_t offset = 0; offset != length; offset += 16) {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + offset));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(destination + offset), value);
+    }
+}
+
+__attribute__((target("avx2")))
+static void streamAvx2(char* destination, const char* source, uint64_t length) {
+    for(uint64_t offset = 0; offset != length; offset += 32) {
+        __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + offset));
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(destination + offset), value);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void streamAvx512(char* destination, const char* source, uint64_t length) {
+    for(uint64_t offset = 0; offset != length; offset += 64) {
+        __m512i value = _mm512_loadu_si512(source + offset);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(destination + offset), value);
+    }
+}
+
+struct StreamKernel {
+    void (*stream)(char*, const char*, uint64_t);
+    uint64_t width;
+    const char* name;
+};
+
+static bool Supported(const StreamKernel& candidate) {
+    __builtin_cpu_init();
+    if(candidate.width == 64) return __builtin_cpu_supports("avx512f");
+    if(candidate.width == 32) return __builtin_cpu_supports("avx2");
+    return true;
+}
+
+// widest first
+static const StreamKernel kernels[] = {
+    {streamAvx512, 64, "avx512"},
+    {streamAvx2, 32, "avx2"},
+    {streamSse2, 16, "sse2"}
+};
+
+static StreamKernel PickKernel() {
+    for(const auto& candidate : kernels) {
+        if(Supported(candidate)) return candidate;
+    }
+    return kernels[2];
+}
+
+static StreamKernel kernel = PickKernel();
+
+// unaligned head and the tail go through memcpy, the body is streamed
+static void streamCopy(char* destination, const char* source, uint64_t length) {
+    uint64_t head = (kernel.width - reinterpret_cast<uintptr_t>(destination) % kernel.width) % kernel.width;
+    if(head > length) head = length;
+    std::memcpy(destination, source, head);
+
+    uint64_t body = (length - head) / kernel.width * kernel.width;
+    kernel.stream(destination + head, source + head, body);
+
+    std::memcpy(destination + head + body, source + head + body, length - head - body);
+}
+
+static void prefetch(const void* source, uint64_t length) {
+    const char* line = static_cast<const char*>(source);
+    for(int i = 0; i != prefetchLines && i * cacheLine < length; ++i) {
+        _mm_prefetch(line + i * cacheLine, _MM_HINT_T0);
+    }
+}
+
+#else
+
+static void streamCopy(char* destination, const char* source, uint64_t length) {
+    std::memcpy(destination, source, length);
+}
+
+static void prefetch(const void* source, uint64_t length) {
+    __builtin_prefetch(source);
+}
+
+#endif
+
+void CopyGather(void* destination, const CopySegment* segments, std::size_t segmentCount) {
+    uint64_t total = 0;
+    for(std::size_t i = 0; i != segmentCount; ++i) total += segments[i].length;
+    bool streaming = total >= streamingThreshold;
+
+    char* out = static_cast<char*>(destination);
+    std::size_t i = 0;
+    while(i != segmentCount) {
+        // sub items written one after the other in a log sit next to each other, copy them as one
+        const char* source = static_cast<const char*>(segments[i].source);
+        uint64_t length = segments[i].length;
+        for(++i; i != segmentCount && segments[i].source == source + length; ++i) length += segments[i].length;
+
+        if(i != segmentCount) prefetch(segments[i].source, segments[i].length);
+
+        if(streaming) streamCopy(out, source, length);
+        else std::memcpy(out, source, length);
+        out += length;
+    }
+
+#ifdef COPY_ENGINE_X86
+    // streamed stores aren't ordered with the rest, make them visible before the destager reads them
+    if(streaming) _mm_sfence();
+#endif
+}
+
+const char* CopyEngineName() {
+#ifdef COPY_ENGINE_X86
+    return kernel.name;
+#else
+    return "memcpy";
+#endif
+}
+
+bool SelectCopyEngine(const char* name) {
+#ifdef COPY_ENGINE_X86
+    if(name == nullptr) {
+        kernel = PickKernel();
+        return true;
+    }
+    for(const auto& candidate : kernels) {
+        if(std::strcmp(candidate.name, name) != 0) continue;
+        if(!Supported(candidate)) return false;
+        kernel = candidate;
+        return true;
+    }
+    return false;
+#else
+    return name == nullptr || std::strcmp(name, "memcpy") == 0;
+#endif
+}
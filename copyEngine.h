@@ -0,0 +1,26 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// one piece of a gathered copy
+struct CopySegment {
+    const void* source;
+    uint64_t length;
+};
+
+// copies the segments back to back into destination. Segments with contiguous sources are
+// copied as one, the next segment's source is prefetched while the current one is copied,
+// and copies of at least the streaming threshold bypass the cache with non-temporal stores
+void CopyGather(void* destination, const CopySegment* segments, std::size_t segmentCount);
+
+// the instruction set picked for streaming copies on this machine
+const char* CopyEngineName();
+
+// streams with the named instruction set ("avx512", "avx2" or "sse2") instead, null goes back
+// to the one picked for this machine. False if this machine can't run it.
+// Not thread safe, call while nothing is copying
+bool SelectCopyEngine(const char* name);
+
+#endif
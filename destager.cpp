@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "destager.h"
+#include "targetFile.h"
+
+Destager::Destager(const std::string& targetFilename, int writerCount, std::vector<int> writerCpus) :
+    cpus{std::move(writerCpus)},
+    opened{true},
+    startWriteback{false},
+    preallocation{Preallocation::None},
+    allocatedEnd{0},
+    submittedBatch{0},
+    completedBatch{0},
+    stopping{false}
+{
+    if(writerCount < 1) writerCount = 1;
+
+    for(int i = 0; i != writerCount; ++i) {
+        int fd = open(targetFilename.c_str(), O_WRONLY | O_CREAT, 0666);
+        if(fd < 0) {
+            std::cerr << "destager.cpp: Error opening file \"" << targetFilename << "\"\n";
+            perror("Error:");
+            opened = false;
+            break;
+        }
+        fds.push_back(fd);
+    }
+
+    // an existing target is already laid out up to its size, Full only allocates past it
+    struct stat fileStat;
+    if(!fds.empty() && fstat(fds[0], &fileStat) == 0) allocatedEnd = fileStat.st_size;
+
+    for(int i = 0; i != fds.size(); ++i) {
+        writers.emplace_back(&Destager::writerLoop, this, i, fds[i]);
+    }
+}
+
+Destager::~Destager() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+    }
+    pendingCv.notify_all();
+    for(auto& writer : writers) writer.join();
+    for(int fd : fds) close(fd);
+}
+
+bool Destager::destage(const std::vector<MergerItem>& items,
+        const std::function<void(std::size_t, std::size_t)>& onRangeComplete) {
+    return destage(items.data(), items.data() + items.size(), onRangeComplete);
+}
+
+bool Destager::destage(const MergerItem* first, const MergerItem* last,
+        const std::function<void(std::size_t, std::size_t)>& onRangeComplete) {
+    if(first == last) return true;
+    uint64_t batch = submit(first, last);
+
+    bool ok = true;
+    while(completedBatch < batch) {
+        ok = reapRanges(true, [&](const Range& range) {
+            if(range.batch->number == batch && onRangeComplete) onRangeComplete(range.first, range.last);
+        }) && ok;
+    }
+    return ok;
+}
+
+uint64_t Destager::submit(const MergerItem* first, const MergerItem* last) {
+    std::size_t itemCount = last - first;
+    if(itemCount == 0) return submittedBatch;
+
+    auto batch = std::make_shared<Batch>();
+    batch->number = ++submittedBatch;
+    batch->writes.reserve(itemCount);
+    for(auto* item = first; item != last; ++item) {
+        // there should only be one
+        const auto& logItem = item->getLogItems()[0];
+        batch->writes.push_back(Write{static_cast<char*>(logItem.sourceData) + logItem.item.data_offset,
+                item->getLength(), logItem.item.target_offset});
+    }
+    batches.push_back(batch);
+
+    if(writers.empty()) {
+        batch->rangesLeft = 1;
+        std::lock_guard<std::mutex> lock{mutex};
+        done.push_back(Range{batch, 0, itemCount, 0, 0, false});
+        return batch->number;
+    }
+
+    if(preallocation != Preallocation::None) {
+        // with Full, whatever an earlier destage allocated is already there
+        std::vector<TargetRange> covered = CoveredRanges(first, last);
+        if(PreallocateTarget(fds[0], covered, preallocation, allocatedEnd)) {
+            allocatedEnd = std::max(allocatedEnd, covered.back().offset + covered.back().length);
+        }
+        else {
+            std::cerr << "destager.cpp: Unable to preallocate the target, leaving it to the writes.\n";
+            preallocation = Preallocation::None;
+        }
+    }
+
+    uint64_t totalBytes = 0;
+    for(auto* item = first; item != last; ++item) totalBytes += item->getLength();
+
+    // split into ranges of roughly equal size, never splitting an item
+    // items are sorted, but extents merged at different times can overlap. Those stay in one range,
+    // so each range covers a disjoint region of the file and overlaps are written in item order
+    uint64_t rangeBytes = totalBytes / writers.size() + 1;
+    std::vector<Range> ranges;
+    std::size_t rangeFirst = 0;
+    uint64_t curBytes = 0;
+    uint64_t rangeEnd = 0;
+    for(std::size_t i = 0; i != itemCount; ++i) {
+        curBytes += first[i].getLength();
+        rangeEnd = std::max(rangeEnd, first[i].getEnd());
+        if(i + 1 == itemCount || (curBytes >= rangeBytes && first[i + 1].getBaseOffset() >= rangeEnd)) {
+            ranges.push_back(Range{batch, rangeFirst, i + 1, first[rangeFirst].getBaseOffset(), rangeEnd, true});
+            rangeFirst = i + 1;
+            curBytes = 0;
+        }
+    }
+    batch->rangesLeft = ranges.size();
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        pending.insert(pending.end(), ranges.begin(), ranges.end());
+    }
+    pendingCv.notify_all();
+    return batch->number;
+}
+
+bool Destager::reap(const WritesDone& onWritten, bool wait) {
+    return reapRanges(wait, [&onWritten](const Range& range) {
+        const Write* writes = range.batch->writes.data();
+        onWritten(writes + range.first, writes + range.last);
+    });
+}
+
+bool Destager::drain(const WritesDone& onWritten) {
+    bool ok = true;
+    while(completedBatch != submittedBatch) ok = reap(onWritten, true) && ok;
+    return ok;
+}
+
+uint64_t Destager::getCompletedDestage() const {
+    return completedBatch;
+}
+
+bool Destager::reapRanges(bool wait, const std::function<void(const Range&)>& onRange) {
+    std::deque<Range> written;
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        if(wait && completedBatch != submittedBatch) doneCv.wait(lock, [this]{ return !done.empty(); });
+        written.swap(done);
+    }
+
+    bool ok = true;
+    for(const auto& range : written) {
+        ok = ok && range.ok;
+        onRange(range);
+        --range.batch->rangesLeft;
+    }
+    while(!batches.empty() && batches.front()->rangesLeft == 0) {
+        completedBatch = batches.front()->number;
+        batches.pop_front();
+    }
+    return ok;
+}
+
+bool Destager::overlapsActive(const Range& range) const {
+    for(const auto& other : active) {
+        if(range.start < other.end && other.start < range.end) return true;
+    }
+    return false;
+}
+
+void Destager::setPreallocation(Preallocation mode) {
+    preallocation = mode;
+}
+
+void Destager::setStartWriteback(bool start) {
+    std::lock_guard<std::mutex> lock{mutex};
+    startWriteback = start;
+}
+
+bool Destager::sync() {
+    if(fds.empty()) return false;
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        doneCv.wait(lock, [this]{ return pending.empty() && active.empty(); });
+    }
+    // any descriptor will do, they all share the file's pages
+    while(fdatasync(fds[0]) != 0) {
+        if(errno == EINTR) continue;
+        perror("destager.cpp: fdatasync");
+        return false;
+    }
+    return true;
+}
+
+int Destager::getWriterCount() const {
+    return writers.size();
+}
+
+bool Destager::good() const {
+    return opened;
+}
+
+void Destager::writerLoop(int writerNum, int fd) {
+    if(!cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpus[writerNum % cpus.size()], &cpuSet);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if(err != 0) std::cerr << "destager.cpp: Unable to pin writer " << writerNum << ", error " << err << '\n';
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    while(true) {
+        // the front waits for any earlier range it overlaps, later ones wait behind it
+        pendingCv.wait(lock, [this]{
+            return (stopping && pending.empty()) || (!pending.empty() && !overlapsActive(pending.front()));
+        });
+        if(pending.empty()) return;
+
+        Range range = pending.front();
+        pending.pop_front();
+        active.push_back(range);
+        bool writeback = startWriteback;
+        lock.unlock();
+
+        const Write* writes = range.batch->writes.data();
+        for(std::size_t i = range.first; i != range.last; ++i) {
+            range.ok = WriteTarget(fd, writes[i].source, writes[i].length, writes[i].targetOffset) && range.ok;
+        }
+
+        if(writeback) {
+            // ranges are disjoint, kick off writeback for the whole span without waiting on it
+            if(sync_file_range(fd, range.start, range.end - range.start, SYNC_FILE_RANGE_WRITE) != 0)
+                perror("destager.cpp: sync_file_range");
+        }
+
+        lock.lock();
+        active.erase(std::find_if(active.begin(), active.end(), [&range](const Range& other) {
+            return other.batch == range.batch && other.first == range.first;
+        }));
+        done.push_back(range);
+        doneCv.notify_all();
+        // a range held back by this one can go now
+        pendingCv.notify_all();
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef DESTAGER_H
+#define DESTAGER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mergerItem.h"
+#include "targetFile.h"
+
+/*
+ * Writes merged items out to the target file from several writer threads.
+ * Each writer owns its own file descriptor, a destage splits the sorted
+ * items into disjoint file ranges and each range is written by one writer.
+ * Overlapping items always share a range, so they're written in item order.
+ * A range is only started once every earlier range it overlaps is done,
+ * so destages queued one after another land in the order they were queued.
+ */
+class Destager {
+public:
+    // one item of a queued destage, the destager keeps these rather than the items
+    struct Write {
+        const char* source;
+        uint64_t length;
+        uint64_t targetOffset;
+    };
+    using WritesDone = std::function<void(const Write* first, const Write* last)>;
+
+    // writer i is pinned to writerCpus[i % writerCpus.size()], no pinning if empty
+    Destager(const std::string& targetFilename, int writerCount, std::vector<int> writerCpus);
+    ~Destager();
+
+    Destager(const Destager&) = delete;
+    Destager& operator=(const Destager&) = delete;
+
+    // items must be sorted with a single log item each (the output of a merge)
+    // onRangeComplete is called on the calling thread with the item indices [first, last)
+    // of each range as soon as that range has been written, before destage returns
+    // it is called for failed ranges too, every item is done with once destage returns
+    // anything queued earlier is waited for as well, without a callback
+    // returns false if any write failed
+    bool destage(const std::vector<MergerItem>& items,
+            const std::function<void(std::size_t, std::size_t)>& onRangeComplete = {});
+    // same as above for the items in [first, last)
+    bool destage(const MergerItem* first, const MergerItem* last,
+            const std::function<void(std::size_t, std::size_t)>& onRangeComplete = {});
+
+    // queues the items in [first, last) and returns without waiting for them to be written
+    // the items themselves may go right away, the data they point at has to stay until reaped
+    // returns the number of this destage, counting up from 1, or of the last one if there's nothing to queue
+    uint64_t submit(const MergerItem* first, const MergerItem* last);
+    // hands the writes of each range written since the last call to onWritten on the calling thread,
+    // failed ones too. With wait, blocks until there is at least one unless nothing is queued
+    // returns false if any of them failed
+    bool reap(const WritesDone& onWritten, bool wait);
+    // reaps until nothing is queued
+    bool drain(const WritesDone& onWritten);
+    // every destage up to this one has been written and reaped
+    uint64_t getCompletedDestage() const;
+
+    // allocate the target ranges of each destage before writing them, only from the calling thread
+    void setPreallocation(Preallocation mode);
+    // ask the kernel to start writeback of each range as soon as it is written
+    void setStartWriteback(bool start);
+    // blocks until everything written so far is on stable storage, waits for queued writes first
+    bool sync();
+
+    int getWriterCount() const;
+    bool good() const;
+
+private:
+    struct Batch {
+        uint64_t number;
+        std::vector<Write> writes;
+        std::size_t rangesLeft;
+    };
+
+    struct Range {
+        std::shared_ptr<Batch> batch;
+        std::size_t first;
+        std::size_t last;
+        // the part of the file the range covers
+        uint64_t start;
+        uint64_t end;
+        bool ok;
+    };
+
+    bool reapRanges(bool wait, const std::function<void(const Range&)>& onRange);
+    // with the mutex held
+    bool overlapsActive(const Range& range) const;
+    void writerLoop(int writerNum, int fd);
+
+    std::vector<std::thread> writers;
+    std::vector<int> fds;
+    std::vector<int> cpus;
+    bool opened;
+    bool startWriteback;
+    Preallocation preallocation;
+    uint64_t allocatedEnd; // everything below this is allocated under Preallocation::Full
+
+    // only touched by the calling thread
+    std::deque<std::shared_ptr<Batch>> batches;
+    uint64_t submittedBatch;
+    uint64_t completedBatch;
+
+    std::mutex mutex;
+    std::condition_variable pendingCv;
+    std::condition_variable doneCv;
+    std::deque<Range> pending;
+    std::vector<Range> active; // being written
+    std::deque<Range> done;
+    bool stopping;
+};
+
+#endif
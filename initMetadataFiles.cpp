@@ -21,6 +21,7 @@ int main(int argc, char** argv) {
         chunkBuffer[i].next_chunk = i + 1;
     }
     chunkBuffer[M_CHUNK_COUNT - 1].next_chunk = 0;
+    m_control control{0, 0, 0, 0};
 
     std::cout << "Writing base data to metadata files\n";
     for(const auto& filename : filenames) {
@@ -30,6 +31,7 @@ int main(int argc, char** argv) {
             return 1;
         }
         file.write(reinterpret_cast<char*>(chunkBuffer.data()), chunkBuffer.size() * sizeof(m_chunk));
+        file.write(reinterpret_cast<char*>(&control), sizeof(control));
     }
 
     std::cout << "Metadata files initialized\n";
@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logMapper.h"
+
+LogMapper::LogMapper(int threadCount, const std::string& directory, bool growMetadata_, bool skipEmpty_) :
+    dirFd{AT_FDCWD},
+    growMetadata{growMetadata_},
+    skipEmpty{skipEmpty_},
+    nextLog{0},
+    stopping{false}
+{
+    if(directory != "") {
+        dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if(dirFd < 0) {
+            std::cerr << "logMapper.cpp: Error opening directory \"" << directory << "\"\n";
+            perror("Error:");
+        }
+    }
+
+    if(threadCount < 1) threadCount = 1;
+    for(int i = 0; i != threadCount; ++i) mappers.emplace_back(&LogMapper::mapperLoop, this);
+}
+
+LogMapper::~LogMapper() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+    }
+    pendingCv.notify_all();
+    for(auto& mapper : mappers) mapper.join();
+
+    for(std::size_t i = 0; i != logs.size(); ++i) {
+        if(mapped[i]) release(i);
+    }
+    if(dirFd >= 0) close(dirFd);
+}
+
+std::size_t LogMapper::add(const std::string& metadataFile, const std::string& dataFile,
+        std::size_t metadataSize, std::size_t dataSize) {
+    std::size_t index;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        index = logs.size();
+        logs.push_back(MappedLog{metadataFile, dataFile, nullptr, nullptr, metadataSize, dataSize, false, false});
+        mapped.push_back(false);
+    }
+    pendingCv.notify_one();
+    return index;
+}
+
+const MappedLog& LogMapper::get(std::size_t index) {
+    std::unique_lock<std::mutex> lock{mutex};
+    mappedCv.wait(lock, [this, index]{ return mapped[index]; });
+    return logs[index];
+}
+
+void LogMapper::release(std::size_t index) {
+    MappedLog& log = logs[index];
+    if(log.metadata != nullptr) munmap(log.metadata, log.metadataSize);
+    if(log.data != nullptr) munmap(log.data, log.dataSize);
+    log.metadata = nullptr;
+    log.data = nullptr;
+}
+
+std::size_t LogMapper::getLogCount() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return logs.size();
+}
+
+int LogMapper::getDirectoryFd() const {
+    return dirFd;
+}
+
+void LogMapper::mapperLoop() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while(true) {
+        pendingCv.wait(lock, [this]{ return stopping || nextLog != logs.size(); });
+        if(nextLog == logs.size()) return;
+
+        std::size_t index = nextLog++;
+        MappedLog& log = logs[index];
+        lock.unlock();
+        mapLog(log);
+        lock.lock();
+
+        mapped[index] = true;
+        mappedCv.notify_all();
+    }
+}
+
+void* LogMapper::mapOne(const std::string& filename, std::size_t size, bool populate, bool grow) {
+    int file = openat(dirFd, filename.c_str(), O_RDWR);
+    if(file < 0) {
+        std::cerr << "logMapper.cpp: Error opening file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+
+    // mapping past the end of the file would fault on first touch
+    struct statx fileStat;
+    if(statx(file, "", AT_EMPTY_PATH, STATX_SIZE, &fileStat) == 0 && fileStat.stx_size < size) {
+        if(!grow || ftruncate(file, size) != 0) {
+            std::cerr << "logMapper.cpp: \"" << filename << "\" is " << fileStat.stx_size <<
+                " bytes, expected " << size << '\n';
+            close(file);
+            return nullptr;
+        }
+    }
+
+    int flags = MAP_SHARED;
+    if(populate) flags |= MAP_POPULATE;
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, file, 0);
+    close(file);
+    if(data == MAP_FAILED) {
+        std::cerr << "logMapper.cpp: Error mapping file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+    return data;
+}
+
+void LogMapper::mapLog(MappedLog& log) {
+    log.metadata = static_cast<m_chunk*>(mapOne(log.metadataFile, log.metadataSize, true, growMetadata));
+    if(log.metadata == nullptr) return;
+
+    for(int i = 0; i != M_CHUNK_COUNT && !log.live; ++i) {
+        if(!log.metadata[i].free) log.live = true;
+    }
+    if(!log.live && skipEmpty) {
+        log.ok = true;
+        return;
+    }
+
+    log.data = mapOne(log.dataFile, log.dataSize, false, false);
+    log.ok = log.data != nullptr;
+}
+
+bool ListRegularFiles(int dirFd, std::vector<std::string>& filenames) {
+    // closedir closes the descriptor it's given, the caller keeps its own
+    int listFd = dup(dirFd);
+    DIR* dir = listFd < 0 ? nullptr : fdopendir(listFd);
+    if(dir == nullptr) {
+        if(listFd >= 0) close(listFd);
+        perror("Error listing directory:");
+        return false;
+    }
+
+    while(dirent* entry = readdir(dir)) {
+        if(entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            // follows the link, a log may live elsewhere and be linked into the folder
+            struct statx fileStat;
+            if(statx(dirFd, entry->d_name, 0, STATX_TYPE, &fileStat) != 0 || !S_ISREG(fileStat.stx_mode)) continue;
+        }
+        else if(entry->d_type != DT_REG) continue;
+        filenames.emplace_back(entry->d_name);
+    }
+    closedir(dir);
+    return true;
+}
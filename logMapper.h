@@ -0,0 +1,82 @@
+#ifndef LOG_MAPPER_H
+#define LOG_MAPPER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mChunk.h"
+
+// one metadata/data log pair once it has been mapped
+struct MappedLog {
+    std::string metadataFile;
+    std::string dataFile;
+    m_chunk* metadata;
+    void* data; // null if the ring was empty and empty logs are skipped
+    std::size_t metadataSize;
+    std::size_t dataSize;
+    bool live; // the ring had at least one chunk in use when it was mapped
+    bool ok;
+};
+
+/*
+ * Opens and maps log pairs from a pool of threads, so startup with many logs isn't
+ * one open and mmap after another. Logs can be used as soon as they are mapped,
+ * while later ones are still being mapped. Metadata pages are faulted in up front
+ * since the whole ring is read right away, data pages are left to fault on use.
+ */
+class LogMapper {
+public:
+    // names are relative to directory, or as given if it's empty
+    // growMetadata extends metadata files shorter than their mapping, ones from before the control block
+    // a short data log always fails, its missing tail would be read as data
+    // skipEmpty leaves the data of logs without live chunks unmapped
+    LogMapper(int threadCount, const std::string& directory, bool growMetadata, bool skipEmpty);
+    // unmaps every log that hasn't been released
+    ~LogMapper();
+
+    LogMapper(const LogMapper&) = delete;
+    LogMapper& operator=(const LogMapper&) = delete;
+
+    // queues a log pair for mapping, returns its index, logs are mapped in the order they are added
+    std::size_t add(const std::string& metadataFile, const std::string& dataFile,
+            std::size_t metadataSize, std::size_t dataSize);
+    // waits until log index is mapped
+    const MappedLog& get(std::size_t index);
+    // unmaps log index, it must not be used afterwards
+    void release(std::size_t index);
+
+    std::size_t getLogCount() const;
+    // the directory the names are relative to, AT_FDCWD if there is none
+    int getDirectoryFd() const;
+
+private:
+    void mapperLoop();
+    void* mapOne(const std::string& filename, std::size_t size, bool populate, bool grow);
+    void mapLog(MappedLog& log);
+
+    int dirFd;
+    bool growMetadata;
+    bool skipEmpty;
+
+    // deque so references handed out by get stay valid as logs are added
+    std::deque<MappedLog> logs;
+    std::deque<bool> mapped;
+    std::size_t nextLog;
+    bool stopping;
+
+    mutable std::mutex mutex;
+    std::condition_variable pendingCv;
+    std::condition_variable mappedCv;
+    std::vector<std::thread> mappers;
+};
+
+// appends the names of the regular files in the directory, symlinks to regular files included
+// only entries the directory can't type, and symlinks, are stat'ed. Returns false if it can't be read
+bool ListRegularFiles(int dirFd, std::vector<std::string>& filenames);
+
+#endif
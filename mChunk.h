@@ -21,4 +21,14 @@ typedef struct _m_chunk {
     m_item items[M_ITEM_COUNT];
 } m_chunk;
 
+// lives right after the chunk ring in each metadata log, shared with the producers
+typedef struct _m_control {
+    uint64_t backpressure; // set while the merge thread is over its memory budget, producers should hold off
+    uint64_t memory_used; // bytes of merge memory (extent index, sub items and staging) currently held
+    uint64_t durable_merge; // every merge up to this one is on stable storage in the target
+    uint64_t durable_bytes; // bytes written to the target and synced so far
+} m_control;
+
+#define M_METADATA_SIZE (M_CHUNK_COUNT * sizeof(m_chunk) + sizeof(m_control))
+
 #endif
@@ -0,0 +1,24 @@
+#ifndef M_EXTENT_H
+#define M_EXTENT_H
+
+#include <cstdint>
+
+#define M_EXTENT_MAGIC 0x5845444e49474d53ull // "SMGINDEX"
+#define M_EXTENT_VERSION 1
+
+// index written next to the output of a merge stage so the output can be merged again
+typedef struct _m_extent_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t extent_count; // followed by this many m_extent, sorted by target_offset
+    uint64_t data_size; // bytes of the data file the extents index into
+} m_extent_header;
+
+// one already-coalesced write
+typedef struct _m_extent {
+    uint64_t target_offset; // offset into the final output file
+    uint64_t data_offset; // offset into the data file of this index
+    uint64_t length;
+} m_extent;
+
+#endif
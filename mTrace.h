@@ -0,0 +1,32 @@
+#ifndef M_TRACE_H
+#define M_TRACE_H
+
+#include <cstdint>
+
+#include "mChunk.h"
+
+#define M_TRACE_MAGIC 0x45434152544d4c53ull // "SLMTRACE"
+#define M_TRACE_VERSION 1
+
+#define M_TRACE_FLAG_DATA 1 // records carry the data of their new items
+
+typedef struct _m_trace_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t log_count; // number of metadata/data log pairs that were captured
+    uint64_t flags;
+    uint64_t data_log_size; // size of each data log, replay creates its logs this large
+} m_trace_header;
+
+// one changed chunk, written whenever a capture snapshot sees a chunk differ from the last one
+typedef struct _m_trace_record {
+    uint64_t timestamp_ns; // time since the start of the capture
+    uint32_t log; // which metadata/data log pair
+    uint32_t chunk_index; // index of the chunk in the ring
+    uint32_t new_chunk; // chunk was free (or restarted) in the last snapshot
+    uint32_t first_item; // items before this one were already recorded
+    m_chunk chunk;
+    // if M_TRACE_FLAG_DATA is set, followed by req_len bytes for each item in [first_item, item_count)
+} m_trace_record;
+
+#endif
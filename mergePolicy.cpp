@@ -0,0 +1,130 @@
+#include <algorithm>
+
+#include "mChunk.h"
+#include "mergePolicy.h"
+
+// rates are resampled at most this often, passes of the merge loop are much closer together
+static const std::chrono::microseconds sampleInterval{500};
+// weight of the newest sample in the smoothed rates
+static const double rateWeight = 0.25;
+// a ring with this few free chunks gets merged whatever its rate
+static const int reserveChunks = M_CHUNK_COUNT / 16;
+// leave this many merges' worth of time before a ring would fill
+static const double overflowMargin = 4.0;
+// the merge ratio has to move by this much before the threshold follows
+static const double ratioTolerance = 0.03;
+
+FixedMergePolicy::FixedMergePolicy(int chunkThreshold_, std::size_t maxMasterItemCount_) :
+    chunkThreshold{chunkThreshold_},
+    maxMasterItemCount{maxMasterItemCount_}
+{}
+
+TriggerReason FixedMergePolicy::shouldMerge(const MergeObservation& observation) {
+    for(int used : observation.usedChunks) {
+        if(used > chunkThreshold) return TriggerReason::Threshold;
+    }
+    return TriggerReason::None;
+}
+
+TriggerReason FixedMergePolicy::shouldDestage(const DestageObservation& observation) {
+    // destage before the ring is so full the next merge has to split or stall on it
+    if(observation.stagedBytes >= observation.stagingLimit - observation.stagingLimit / 8 ||
+            observation.masterItemCount > maxMasterItemCount) return TriggerReason::Threshold;
+    return TriggerReason::None;
+}
+
+AdaptiveMergePolicy::AdaptiveMergePolicy(int baseThreshold_, std::size_t maxMasterItemCount_,
+        std::chrono::steady_clock::duration idleTime_) :
+    baseThreshold{std::max(1, baseThreshold_)},
+    maxThreshold{std::max(baseThreshold, M_CHUNK_COUNT / 2)},
+    threshold{baseThreshold},
+    maxMasterItemCount{maxMasterItemCount_},
+    idleTime{idleTime_},
+    sampled{false},
+    mergeTime{0},
+    lastRatio{0}
+{}
+
+void AdaptiveMergePolicy::updateRates(const MergeObservation& observation) {
+    const auto& filled = observation.filledChunks;
+    if(!sampled || fillRates.size() != filled.size()) {
+        fillRates.assign(filled.size(), 0);
+        sampledFilled = filled;
+        sampleTime = observation.now;
+        lastActivity = observation.now;
+        sampled = true;
+        return;
+    }
+
+    auto elapsed = observation.now - sampleTime;
+    if(elapsed < sampleInterval) return;
+    double seconds = std::chrono::duration<double>(elapsed).count();
+
+    for(std::size_t i = 0; i != filled.size(); ++i) {
+        uint64_t newChunks = filled[i] - sampledFilled[i];
+        if(newChunks != 0) lastActivity = observation.now;
+        fillRates[i] = rateWeight * (newChunks / seconds) + (1 - rateWeight) * fillRates[i];
+    }
+    sampledFilled = filled;
+    sampleTime = observation.now;
+}
+
+bool AdaptiveMergePolicy::isIdle(std::chrono::steady_clock::time_point now) const {
+    return sampled && now - lastActivity >= idleTime;
+}
+
+TriggerReason AdaptiveMergePolicy::shouldMerge(const MergeObservation& observation) {
+    updateRates(observation);
+
+    const auto& used = observation.usedChunks;
+    bool anyUsed = false;
+    bool pastBase = false;
+    bool pastThreshold = false;
+    for(std::size_t i = 0; i != used.size(); ++i) {
+        if(used[i] == 0) continue;
+        anyUsed = true;
+
+        // a merge started later than this wouldn't finish before the ring fills
+        int free = observation.freeChunks[i];
+        double secondsLeft = fillRates[i] > 0 ? free / fillRates[i] : 1e9;
+        if(free <= reserveChunks || secondsLeft < overflowMargin * mergeTime) return TriggerReason::Overflow;
+
+        if(used[i] > baseThreshold) pastBase = true;
+        if(used[i] > threshold) pastThreshold = true;
+    }
+    if(!anyUsed) return TriggerReason::None;
+
+    if(isIdle(observation.now)) return TriggerReason::Idle;
+    if(pastThreshold) return TriggerReason::Threshold;
+    if(pastBase) return TriggerReason::Deferred;
+    return TriggerReason::None;
+}
+
+void AdaptiveMergePolicy::mergeDone(TriggerReason reason, uint64_t itemsIn, uint64_t itemsOut,
+        std::chrono::steady_clock::duration took) {
+    double seconds = std::chrono::duration<double>(took).count();
+    mergeTime = mergeTime == 0 ? seconds : rateWeight * seconds + (1 - rateWeight) * mergeTime;
+
+    // idle and overflow merges are cut short on purpose, their ratio says nothing about the threshold
+    if(reason != TriggerReason::Threshold || itemsIn == 0) return;
+
+    double ratio = static_cast<double>(itemsOut) / itemsIn;
+    if(lastRatio != 0) {
+        // waiting longer found more to coalesce, wait longer still
+        if(ratio < lastRatio * (1 - ratioTolerance)) threshold = std::min(maxThreshold, threshold * 2);
+        else if(ratio > lastRatio * (1 + ratioTolerance)) threshold = std::max(baseThreshold, threshold / 2);
+    }
+    lastRatio = ratio;
+}
+
+TriggerReason AdaptiveMergePolicy::shouldDestage(const DestageObservation& observation) {
+    if(observation.stagedBytes >= observation.stagingLimit - observation.stagingLimit / 8 ||
+            observation.masterItemCount > maxMasterItemCount) return TriggerReason::Threshold;
+    // the application isn't writing, get the target writes out of its way
+    if(observation.masterItemCount != 0 && isIdle(observation.now)) return TriggerReason::Idle;
+    return TriggerReason::None;
+}
+
+int AdaptiveMergePolicy::getThreshold() const {
+    return threshold;
+}
@@ -0,0 +1,107 @@
+#ifndef MERGE_POLICY_H
+#define MERGE_POLICY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// why a policy wants to merge or destage, the merge thread keeps a counter for each
+enum class TriggerReason {
+    None = 0,
+    Threshold = 1, // enough has piled up
+    Idle = 2, // the application has gone quiet, use the time
+    Overflow = 3, // a ring would fill up before a later merge could finish
+    Deferred = 4 // past the usual threshold, but waiting is expected to pay off
+};
+
+// what the merge thread sees of the logs on each pass of its loop
+struct MergeObservation {
+    std::chrono::steady_clock::time_point now;
+    std::vector<int> usedChunks; // full chunks waiting to be merged, per log
+    std::vector<int> freeChunks; // chunks the producers can still fill, per log
+    std::vector<uint64_t> filledChunks; // running total of chunks filled, per log
+};
+
+// what the merge thread sees of its own buffers after a merge
+struct DestageObservation {
+    std::chrono::steady_clock::time_point now;
+    uint64_t stagedBytes;
+    uint64_t stagingLimit;
+    std::size_t masterItemCount;
+};
+
+/*
+ * Decides when the merge thread merges the logs and when it destages the master merger.
+ * Only the merge thread calls a policy, so it doesn't need to be thread safe. Memory budget,
+ * durability and flush requests are enforced by the merge thread whatever the policy says.
+ */
+class MergePolicy {
+public:
+    virtual ~MergePolicy() = default;
+
+    // called on every pass, anything but None or Deferred starts a merge
+    virtual TriggerReason shouldMerge(const MergeObservation& observation) = 0;
+    // called after each merge the policy started, itemsIn log items became itemsOut merged items
+    virtual void mergeDone(TriggerReason reason, uint64_t itemsIn, uint64_t itemsOut,
+            std::chrono::steady_clock::duration took) {}
+    // called after each merge, anything but None destages
+    virtual TriggerReason shouldDestage(const DestageObservation& observation) = 0;
+};
+
+// merges once any log has more than chunkThreshold full chunks, destages when staging is
+// nearly full or the master merger holds more than maxMasterItemCount items
+class FixedMergePolicy : public MergePolicy {
+public:
+    FixedMergePolicy(int chunkThreshold, std::size_t maxMasterItemCount);
+
+    TriggerReason shouldMerge(const MergeObservation& observation) override;
+    TriggerReason shouldDestage(const DestageObservation& observation) override;
+
+private:
+    int chunkThreshold;
+    std::size_t maxMasterItemCount;
+};
+
+/*
+ * Tracks how fast each ring fills and how well merges coalesce. Merges and destages as soon
+ * as the application goes idle, lets the chunk threshold grow while bigger merges keep finding
+ * more adjacent items, and always merges before a ring would fill up at its current rate.
+ */
+class AdaptiveMergePolicy : public MergePolicy {
+public:
+    // baseThreshold is where the threshold starts and the lowest it goes
+    AdaptiveMergePolicy(int baseThreshold, std::size_t maxMasterItemCount,
+            std::chrono::steady_clock::duration idleTime = std::chrono::milliseconds(5));
+
+    TriggerReason shouldMerge(const MergeObservation& observation) override;
+    void mergeDone(TriggerReason reason, uint64_t itemsIn, uint64_t itemsOut,
+            std::chrono::steady_clock::duration took) override;
+    TriggerReason shouldDestage(const DestageObservation& observation) override;
+
+    int getThreshold() const;
+
+private:
+    void updateRates(const MergeObservation& observation);
+    bool isIdle(std::chrono::steady_clock::time_point now) const;
+
+    int baseThreshold;
+    int maxThreshold;
+    int threshold;
+    std::size_t maxMasterItemCount;
+    std::chrono::steady_clock::duration idleTime;
+
+    // fill rate of each ring in chunks per second, smoothed
+    std::vector<double> fillRates;
+    std::vector<uint64_t> sampledFilled;
+    std::chrono::steady_clock::time_point sampleTime;
+    std::chrono::steady_clock::time_point lastActivity;
+    bool sampled;
+
+    // smoothed, in seconds
+    double mergeTime;
+    // merged items out per log item in of the last threshold merge, lower finds more adjacency
+    double lastRatio;
+};
+
+#endif
@@ -3,25 +3,94 @@
 #include <algorithm>
 #include <vector>
 #include <thread>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "merger.h"
 #include "mergeThread.h"
+#include "destager.h"
+#include "logMapper.h"
+#include "mergePolicy.h"
 
 static bool keepMerging = true;
 static Merger MasterMerger{2048};
 static std::thread MergeThread_;
 static bool paused = false;
-static int curOutOffset = 0;
+static int destageWriterCount = 1;
+static std::vector<int> destageWriterCpus;
+static MergeThread::TargetPreallocation targetPreallocation = MergeThread::TargetPreallocation::None;
+static bool truncateTarget = true;
+static MergeThread::MergePolicyKind mergePolicyKind = MergeThread::MergePolicyKind::Fixed;
+static std::shared_ptr<MergePolicy> customMergePolicy;
+static std::unique_ptr<Destager> destager;
+// threads opening and mapping the logs at startup
+static const int mapThreadCount = 8;
+
+static std::atomic<uint64_t> mergeCount{0};
+static std::atomic<uint64_t> destagedMergeCount{0};
+static std::atomic<uint64_t> destageCount{0};
+static std::atomic<uint64_t> destagedBytes{0};
+static std::atomic<uint64_t> thresholdMerges{0};
+static std::atomic<uint64_t> idleMerges{0};
+static std::atomic<uint64_t> overflowMerges{0};
+static std::atomic<uint64_t> deferredMerges{0};
+static std::atomic<uint64_t> idleDestages{0};
+
+// staging space handed to MergeData when there is no memory budget
+static const int stagingSize = 131072;
+static StagingRing staging{stagingSize};
+static void* stagingData = nullptr;
+static std::atomic<uint64_t> requestedMemoryBudget{0}; // 0 means unlimited
+static uint64_t memoryBudget = 0; // the merge thread's copy, taken at start
+static std::atomic<bool> backpressure{false};
+static std::mutex backpressureMutex;
+static std::condition_variable backpressureCv;
+// extent index and sub items the master merger holds, counted as items go in rather than walked
+static uint64_t masterMemoryUsage = 0;
+// what the control blocks say, they're only written again when it changes
+static bool publishedBackpressure = false;
+static uint64_t publishedMemoryUsed = 0;
+
+static MergeThread::DurabilityPolicy durabilityPolicy = MergeThread::DurabilityPolicy::None;
+static uint64_t durabilityParam = 0;
+static std::atomic<bool> syncRequested{false};
+static std::atomic<uint64_t> durableMergeCount{0};
+static uint64_t bytesSinceSync = 0;
+static uint64_t durableBytes = 0;
+static std::chrono::steady_clock::time_point lastSync;
+// consumed chunks aren't handed back to the producers until their data is durable
+// staged: data is still in outData, written: data is in the target but not synced yet
+static std::vector<ChunkRef> stagedChunks;
+static std::vector<ChunkRef> writtenChunks;
+// consumed chunks that aren't free yet, the end of the ring must not run into them
+static std::vector<std::vector<char>> chunkPending;
+static std::vector<int> pendingChunkCounts;
+
+// flush tickets, tickets up to completedFlush are done
+static std::atomic<uint64_t> requestedFlush{0};
+static uint64_t completedFlush = 0; // guarded by flushMutex
+static bool flushesTaken = false; // guarded by flushMutex, set while there's a merge thread to handle them
+static uint64_t handledFlush = 0; // merge thread's own copy
+static std::mutex flushMutex;
+static std::condition_variable flushCv;
+// items of a partly filled chunk that a flush already wrote
+static std::vector<std::vector<int>> flushedItemCounts;
 
 static void StartMergeThread_(const std::string targetFilename,
         std::vector<std::string> metadataFileNames,
         std::vector<std::string> dataFileNames,
         const std::string outDataFilename,
         int maxChunkInUseCount, int maxMasterItemCount, int stripeSize);
+static void MergeThreadExited();
 
 void MergeThread::StartMergeThread(std::string targetFilename,
         std::vector<std::string> metadataFileNames,
@@ -30,67 +99,309 @@ void MergeThread::StartMergeThread(std::string targetFilename,
         int maxChunkInUseCount, int maxMasterItemCount, int stripeSize) {
 
     keepMerging = true;
+    {
+        std::lock_guard<std::mutex> lock{flushMutex};
+        flushesTaken = true;
+    }
 
-    MergeThread_ = std::thread(StartMergeThread_, std::move(targetFilename),
-            std::move(metadataFileNames), std::move(dataFileNames),
-            std::move(outDataFilename),
-            maxChunkInUseCount, maxMasterItemCount, stripeSize);
+    MergeThread_ = std::thread([=]() {
+        StartMergeThread_(targetFilename, metadataFileNames, dataFileNames, outDataFilename,
+                maxChunkInUseCount, maxMasterItemCount, stripeSize);
+        MergeThreadExited();
+    });
             
 }
 
-static void WriteFromMasterMerger(void* inData, std::ofstream& outputFile) {
-    std::cout << "MergeThread.cpp: Triggered merge from master merger, writing from address " << inData << '\n';
-
-    std::vector<char> buffer;
-    for(auto& item : MasterMerger.getItems()) {
-        // there should only be one
-        auto& logItem = item.getLogItems()[0];
-
-        buffer.resize(item.getLength()); 
-        std::memcpy(buffer.data(), static_cast<char*>(inData) + logItem.item.data_offset, item.getLength());
-
-        outputFile.seekp(logItem.item.target_offset);
-        outputFile.write(buffer.data(), item.getLength());
-
-        /* DEBUG */
-        /*
-        std::cout << "\tCopied data from " << inData << " + " << logItem.item.data_offset <<
-                        " to " << logItem.item.target_offset <<
-                        ", length " << item.getLength();
-        int intCount = item.getLength() / 4;
-        if(intCount == 1) std::cout << ", data: " << *reinterpret_cast<int*>(buffer.data()) << '\n';
-        else {
-            int* data = reinterpret_cast<int*>(buffer.data());
-            std::cout << ", data: ";
-            for(int i = 0; i != 3; ++i) {
-                std::cout << data[i] << ", ";
-            }
-            std::cout << "... ";
-            for(int i = intCount - 3; i != intCount; ++i) {
-                std::cout << data[i] << ", ";
+// destages still being written, and the chunks to hand on once everything up to them is written
+struct QueuedDestage {
+    uint64_t destage;
+    uint64_t completedMerge;
+    std::vector<ChunkRef> chunks;
+};
+static std::deque<QueuedDestage> queuedDestages;
+
+// called as each range is written, its staging space can be reused right away
+// items of partly filled chunks point straight into the data logs and have nothing to release
+static void ReleaseStaging(const Destager::Write* first, const Destager::Write* last) {
+    const char* stagingBegin = static_cast<const char*>(stagingData);
+    for(auto* write = first; write != last; ++write) {
+        if(write->source >= stagingBegin && write->source < stagingBegin + stagingSize)
+            staging.release(write->source - stagingBegin);
+    }
+}
+
+static void RetireDestages() {
+    uint64_t completed = destager->getCompletedDestage();
+    while(!queuedDestages.empty() && queuedDestages.front().destage <= completed) {
+        auto& queued = queuedDestages.front();
+        writtenChunks.insert(writtenChunks.end(), queued.chunks.begin(), queued.chunks.end());
+        destagedMergeCount = queued.completedMerge;
+        if(durabilityPolicy == MergeThread::DurabilityPolicy::None) durableMergeCount = queued.completedMerge;
+        queuedDestages.pop_front();
+    }
+}
+
+// releases the staging of whatever has been written, with wait blocks until something has
+static void ReapDestages(bool wait) {
+    if(!destager->reap(ReleaseStaging, wait)) std::cerr << "mergeThread.cpp: Destage failed!\n";
+    RetireDestages();
+}
+
+static void DrainDestages() {
+    if(!destager->drain(ReleaseStaging)) std::cerr << "mergeThread.cpp: Destage failed!\n";
+    RetireDestages();
+}
+
+// queues the master merger for writing, merging goes on while it's written
+// every merge up to and including completedMerge is either in the master merger or already queued
+static void WriteFromMasterMerger(uint64_t completedMerge) {
+    const auto& items = MasterMerger.getItems();
+    // with nothing to write, only the merges and chunks are handed on once what's queued is written
+    uint64_t queued = destager->submit(items.data(), items.data() + items.size());
+    if(!items.empty()) {
+        std::cout << "MergeThread.cpp: Triggered merge from master merger, writing " <<
+            items.size() << " items with " << destager->getWriterCount() << " writers\n";
+
+        uint64_t bytes = 0;
+        for(const auto& item : items) bytes += item.getLength();
+        destagedBytes += bytes;
+        bytesSinceSync += bytes;
+        ++destageCount;
+    }
+
+    // the merge in progress hasn't handed over its chunks yet, so these all came from completed merges
+    queuedDestages.push_back(QueuedDestage{queued, completedMerge, std::move(stagedChunks)});
+    stagedChunks.clear();
+
+    MasterMerger.clear();
+    masterMemoryUsage = 0;
+    RetireDestages();
+};
+
+// MergeData ran out of staging, the master merger is staged there as well so it goes out first.
+// Staging goes on as soon as some of it has been written
+static void DestageEarly(const MergerItem* first, const MergerItem* last) {
+    // the merge in progress is only partly written
+    WriteFromMasterMerger(mergeCount - 1);
+
+    destager->submit(first, last);
+    uint64_t bytes = 0;
+    for(auto* item = first; item != last; ++item) bytes += item->getLength();
+    destagedBytes += bytes;
+    bytesSinceSync += bytes;
+    ReapDestages(true);
+}
+
+// make everything written so far durable, then free the chunks it came from
+// and advance the watermark in each metadata log
+static void SyncTarget(const std::vector<m_chunk*>& metadata) {
+    DrainDestages();
+    if(!destager->sync()) {
+        std::cerr << "mergeThread.cpp: Sync failed, keeping chunks.\n";
+        return;
+    }
+
+    for(const auto& ref : writtenChunks) {
+        metadata[ref.log][ref.chunk].free = 1;
+        chunkPending[ref.log][ref.chunk] = 0;
+        --pendingChunkCounts[ref.log];
+    }
+    writtenChunks.clear();
+
+    durableBytes += bytesSinceSync;
+    bytesSinceSync = 0;
+    durableMergeCount = destagedMergeCount.load();
+    for(auto* chunks : metadata) {
+        auto* control = reinterpret_cast<m_control*>(chunks + M_CHUNK_COUNT);
+        control->durable_merge = durableMergeCount;
+        control->durable_bytes = durableBytes;
+    }
+
+    syncRequested = false;
+    lastSync = std::chrono::steady_clock::now();
+}
+
+// every item goes into the master merger through here, it's never merged there
+static void AddToMaster(const m_item& item, void* data, uint64_t length) {
+    MasterMerger.addItemNoMerge(item, data, length);
+    masterMemoryUsage += sizeof(MergerItem) + sizeof(TaggedItem);
+}
+
+// the end of each ring stops at the first chunk that isn't full, and nothing from there on is merged
+// until it fills up. That's the chunk a log is still filling, plus any it handed over partly filled
+// and whatever followed them. A flush writes what those have so far straight from the data log,
+// up to the first free chunk. Those items are written again once their chunk is merged.
+static void AddPartialChunks(const std::vector<m_chunk*>& metadata, const std::vector<void*>& data,
+        const std::vector<int>& endIndices) {
+    for(int i = 0; i != metadata.size(); ++i) {
+        int index = endIndices[i];
+        for(int step = 0; step != M_CHUNK_COUNT; ++step) {
+            auto& chunk = metadata[i][index];
+            // pending chunks were merged already, the ring has come back round to them
+            if(chunk.free || chunkPending[i][index]) break;
+
+            int& flushed = flushedItemCounts[i][index];
+            for(int item_num = flushed; item_num < chunk.item_count; ++item_num) {
+                AddToMaster(chunk.items[item_num], data[i], chunk.req_len);
             }
-            std::cout << '\n';
+            flushed = chunk.item_count;
+            index = chunk.next_chunk;
         }
-        */
-        /* END DEBUG */
     }
-    MasterMerger.clear();
+}
 
-    curOutOffset = 0;
-};
+// however the merge thread ended, nothing is left to handle a ticket or lift backpressure.
+// The final flush covers every ticket handed out before it, after an early exit they're as done as they'll get
+static void MergeThreadExited() {
+    {
+        std::lock_guard<std::mutex> lock{flushMutex};
+        flushesTaken = false;
+        completedFlush = requestedFlush;
+        handledFlush = completedFlush;
+    }
+    flushCv.notify_all();
+
+    {
+        std::lock_guard<std::mutex> lock{backpressureMutex};
+        backpressure = false;
+    }
+    backpressureCv.notify_all();
+}
+
+static void CompleteFlush(uint64_t ticket) {
+    handledFlush = ticket;
+    {
+        std::lock_guard<std::mutex> lock{flushMutex};
+        completedFlush = ticket;
+    }
+    flushCv.notify_all();
+}
+
+// batches syncs according to the durability policy rather than syncing every destage
+// a requested sync is honored under any policy
+static void MaybeSyncTarget(const std::vector<m_chunk*>& metadata) {
+    using MergeThread::DurabilityPolicy;
+    bool requested = syncRequested;
+    if(durabilityPolicy == DurabilityPolicy::None && !requested) return;
+    if(bytesSinceSync == 0 && writtenChunks.empty() && stagedChunks.empty() && queuedDestages.empty() &&
+            MasterMerger.getItemCount() == 0) {
+        syncRequested = false;
+        return;
+    }
+
+    // a requested or periodic sync covers everything merged so far, not only what happened to be destaged
+    bool covering = requested;
+    if(durabilityPolicy == DurabilityPolicy::Periodic) {
+        covering = covering || std::chrono::steady_clock::now() - lastSync >= std::chrono::milliseconds(durabilityParam);
+    }
+    bool doSync = covering;
+    if(durabilityPolicy == DurabilityPolicy::EveryNBytes) doSync = doSync || bytesSinceSync >= durabilityParam;
+
+    if(covering && (MasterMerger.getItemCount() != 0 || !stagedChunks.empty())) WriteFromMasterMerger(mergeCount);
+    if(doSync) SyncTarget(metadata);
+}
+
+// chunks waiting on durability can't be refilled. Once they take up half of the rings, or a ring has
+// no chunk left past the one being filled, the producers would wait on a sync the policy may never make
+static bool HoldingChunks(const std::vector<int>& freeChunks) {
+    int pending = 0;
+    for(int i = 0; i != pendingChunkCounts.size(); ++i) {
+        if(pendingChunkCounts[i] != 0 && freeChunks[i] <= 1) return true;
+        pending += pendingChunkCounts[i];
+    }
+    return pending > pendingChunkCounts.size() * M_CHUNK_COUNT / 2;
+}
+
+// only the items MergeData didn't already write out
+static void AddToMasterMerger(const Merger& subMerger, void* outData) {
+    auto& items = subMerger.getItems();
+    for(auto iter = items.begin() + subMerger.getDestagedCount(); iter != items.end(); ++iter) {
+        // possibly don't merge the items here, just insert them
+        // unsure if we want to merge again before outputing
+        AddToMaster(m_item{iter->getDataOffset(), iter->getBaseOffset()}, outData, iter->getLength());
+    }
+}
+
+static uint64_t MemoryUsage() {
+    return masterMemoryUsage + staging.getUsed();
+}
+
+// publish the backpressure state to the producers, both in-process and through the metadata logs
+// called on every pass, so nothing is written unless it changed
+static void SetBackpressure(bool on, const std::vector<m_chunk*>& metadata) {
+    uint64_t used = MemoryUsage();
+    if(on != publishedBackpressure || used != publishedMemoryUsed) {
+        for(auto* chunks : metadata) {
+            auto* control = reinterpret_cast<m_control*>(chunks + M_CHUNK_COUNT);
+            control->memory_used = used;
+            control->backpressure = on;
+        }
+        publishedBackpressure = on;
+        publishedMemoryUsed = used;
+    }
+
+    if(on == backpressure) return;
+    {
+        std::lock_guard<std::mutex> lock{backpressureMutex};
+        backpressure = on;
+    }
+    if(!on) backpressureCv.notify_all();
+}
+
+// with a memory budget, only take as many chunks from each log as there is room for
+// at least one chunk is always taken so merging keeps making progress
+// returns true if any log was cut short
+static bool ClampToBudget(const std::vector<m_chunk*>& metadata,
+        const std::vector<int>& startIndices, std::vector<int>& endIndices) {
+    if(memoryBudget == 0) return false;
+
+    uint64_t used = MemoryUsage();
+    uint64_t available = used < memoryBudget ? memoryBudget - used : 0;
+    uint64_t perLog = available / metadata.size();
 
-static void* mapFile(const std::string& filename) {
+    bool clamped = false;
+    for(int i = 0; i != metadata.size(); ++i) {
+        uint64_t cost = 0;
+        bool taken = false;
+        for(int index = startIndices[i]; index != endIndices[i]; index = (index + 1) % M_CHUNK_COUNT) {
+            auto& chunk = metadata[i][index];
+            if(chunk.free) continue;
+
+            uint64_t chunkCost = chunk.item_count * (sizeof(MergerItem) + sizeof(TaggedItem) + chunk.req_len);
+            if(taken && cost + chunkCost > perLog) {
+                endIndices[i] = index;
+                clamped = true;
+                break;
+            }
+            cost += chunkCost;
+            taken = true;
+        }
+    }
+    return clamped;
+}
+
+// returns null on failure
+static void* mapFile(const std::string& filename, std::size_t size) {
     int file = open(filename.c_str(), O_RDWR, 0666);
     if(file < 0) {
         std::cerr << "Error opening file \"" << filename << "\"\n";
         perror("Error:");
+        return nullptr;
+    }
+    // a file shorter than the mapping would fault on first touch
+    struct stat fileStat;
+    if(fstat(file, &fileStat) != 0 || static_cast<uint64_t>(fileStat.st_size) < size) {
+        std::cerr << "mergeThread.cpp: \"" << filename << "\" is shorter than the " << size << " bytes it's mapped at\n";
+        close(file);
+        return nullptr;
     }
-    void* data = mmap(NULL, M_CHUNK_COUNT * sizeof(m_chunk), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
     if(data == MAP_FAILED) {
         std::cerr << "Error mapping file \"" << filename << "\"\n";
         perror("Error:");
+        return nullptr;
     }
-    close(file);
     return data;
 }
 
@@ -103,32 +414,95 @@ static void StartMergeThread_(const std::string targetFilename,
     std::sort(metadataFileNames.begin(), metadataFileNames.end());
     std::sort(dataFileNames.begin(), dataFileNames.end());
 
-    std::vector<m_chunk*> metadata = std::vector<m_chunk*>(metadataFileNames.size(), nullptr);
-    for(int i = 0; i != metadata.size(); ++i) {
-        metadata[i] = static_cast<m_chunk*>(mapFile(metadataFileNames[i]));
+    // map the logs from a pool, the out data file is mapped meanwhile
+    // every ring is watched from the first pass of the loop, so wait for all of them
+    LogMapper mapper{std::min<int>(mapThreadCount, metadataFileNames.size()), "", true, false};
+    for(int i = 0; i != metadataFileNames.size(); ++i) {
+        mapper.add(metadataFileNames[i], dataFileNames[i], M_METADATA_SIZE, M_CHUNK_COUNT * sizeof(m_chunk));
     }
 
+    void* outData = mapFile(outDataFilename, M_CHUNK_COUNT * sizeof(m_chunk));
+
+    std::vector<m_chunk*> metadata = std::vector<m_chunk*>(metadataFileNames.size(), nullptr);
     std::vector<void*> data = std::vector<void*>(dataFileNames.size(), nullptr);
-    for(int i = 0; i != data.size(); ++i) {
-        data[i] = mapFile(dataFileNames[i]);
+    bool mapped = outData != nullptr;
+    for(int i = 0; i != metadata.size(); ++i) {
+        const MappedLog& log = mapper.get(i);
+        metadata[i] = log.metadata;
+        data[i] = log.data;
+        mapped = mapped && log.ok;
     }
-
-    void* outData = mapFile(outDataFilename);
+    if(!mapped) {
+        std::cerr << "mergeThread.cpp: Unable to map the logs, not merging!\n";
+        if(outData != nullptr) munmap(outData, M_CHUNK_COUNT * sizeof(m_chunk));
+        return;
+    }
+    stagingData = outData;
+    memoryBudget = requestedMemoryBudget;
+    masterMemoryUsage = MasterMerger.getMemoryUsage();
+    // whatever the control blocks held from an earlier run is written over on the first pass
+    publishedBackpressure = true;
+    publishedMemoryUsed = UINT64_MAX;
 
     std::vector<int> currChunkStartIndices = std::vector<int>(metadata.size(), 0);
     std::vector<int> currChunkEndIndices = std::vector<int>(metadata.size(), 0);
 
-    std::ofstream outFile{targetFilename};
-    if(!outFile.good()) {
+    bool deferFree = durabilityPolicy != MergeThread::DurabilityPolicy::None;
+    chunkPending = std::vector<std::vector<char>>(metadata.size(), std::vector<char>(M_CHUNK_COUNT, 0));
+    pendingChunkCounts = std::vector<int>(metadata.size(), 0);
+    flushedItemCounts = std::vector<std::vector<int>>(metadata.size(), std::vector<int>(M_CHUNK_COUNT, 0));
+    stagedChunks.clear();
+    writtenChunks.clear();
+    queuedDestages.clear();
+    bytesSinceSync = 0;
+    lastSync = std::chrono::steady_clock::now();
+
+    // the destage writers don't truncate, start the target over here unless merging into an existing one
+    int outFile = open(targetFilename.c_str(), O_WRONLY | O_CREAT | (truncateTarget ? O_TRUNC : 0), 0666);
+    if(outFile < 0) {
         std::cerr << "Unable to open out file!\n";
         return;
     }
+    close(outFile);
+
+    destager = std::make_unique<Destager>(targetFilename, destageWriterCount, destageWriterCpus);
+    destager->setPreallocation(static_cast<Preallocation>(targetPreallocation));
+    if(!destager->good()) {
+        std::cerr << "Unable to open out file for destage!\n";
+        return;
+    }
+    // get writeback going early so the batched syncs have less left to wait on
+    destager->setStartWriteback(deferFree);
+
+    std::shared_ptr<MergePolicy> policy = customMergePolicy;
+    if(!policy && mergePolicyKind == MergeThread::MergePolicyKind::Adaptive) {
+        policy = std::make_shared<AdaptiveMergePolicy>(maxChunkInUseCount, maxMasterItemCount);
+    }
+    else if(!policy) policy = std::make_shared<FixedMergePolicy>(maxChunkInUseCount, maxMasterItemCount);
+
+    MergeObservation observation;
+    observation.usedChunks = std::vector<int>(metadata.size(), 0);
+    observation.freeChunks = std::vector<int>(metadata.size(), 0);
+    observation.filledChunks = std::vector<uint64_t>(metadata.size(), 0);
+    TriggerReason lastReason = TriggerReason::None;
+    // the last merge left chunks behind for the budget
+    bool clamped = false;
+    bool stagingFailed = false;
 
     while(keepMerging) {
 
         
+        // a flush is handled right away, even while paused
+        uint64_t flushTicket = requestedFlush;
+        bool flushing = flushTicket != handledFlush;
+
         // TODO actually use a cv
-        if(paused) continue;
+        if(paused && !flushing) continue;
+
+        // staging of whatever has been written since the last pass goes back to the ring
+        ReapDestages(false);
+
+        MaybeSyncTarget(metadata);
 
         // check metadata extent for each file
         // flag files with too much
@@ -137,14 +511,20 @@ static void StartMergeThread_(const std::string targetFilename,
         // if second layer full, merge and destage
 
         int metadataFileNum = 0;
-        bool doMerge = false;
         for(auto& chunks : metadata) {
             // move end
             auto* curEndChunk = &chunks[currChunkEndIndices[metadataFileNum]];
 
-            while(!curEndChunk->free && curEndChunk->item_count == M_ITEM_COUNT) {
+            auto& pendingChunks = chunkPending[metadataFileNum];
+            // a ring filled all the way round would end where it starts, the last chunk waits for the next pass
+            while(!curEndChunk->free && curEndChunk->item_count == M_ITEM_COUNT &&
+                    !pendingChunks[currChunkEndIndices[metadataFileNum]] &&
+                    curEndChunk->next_chunk != currChunkStartIndices[metadataFileNum]) {
+                // full now, the whole chunk gets merged
+                flushedItemCounts[metadataFileNum][currChunkEndIndices[metadataFileNum]] = 0;
                 currChunkEndIndices[metadataFileNum] = curEndChunk->next_chunk;
                 curEndChunk = &chunks[curEndChunk->next_chunk];
+                ++observation.filledChunks[metadataFileNum];
             }
             // check if to many chunks in use
             auto startIndex = currChunkStartIndices[metadataFileNum];
@@ -152,79 +532,251 @@ static void StartMergeThread_(const std::string targetFilename,
             int usedChunks = endIndex - startIndex;
             if(usedChunks < 0) usedChunks = (M_CHUNK_COUNT - startIndex) + endIndex;
 
-            if(usedChunks > maxChunkInUseCount) {
-                // std::cout << "mergeThread.cpp: File number " << metadataFileNum << " \"" << metadataFileNames[metadataFileNum] << "\" has triggered a merge.\n";
-                doMerge = true;
-                break;
-            }
+            observation.usedChunks[metadataFileNum] = usedChunks;
+            observation.freeChunks[metadataFileNum] = M_CHUNK_COUNT - usedChunks - pendingChunkCounts[metadataFileNum];
             
             ++metadataFileNum;
         }
 
-        if(!doMerge) continue;
+        // whatever the durability policy says, a merge can't give these chunks back
+        if(deferFree && HoldingChunks(observation.freeChunks)) {
+            WriteFromMasterMerger(mergeCount);
+            SyncTarget(metadata);
+            for(int i = 0; i != metadata.size(); ++i) {
+                observation.freeChunks[i] = M_CHUNK_COUNT - observation.usedChunks[i] - pendingChunkCounts[i];
+            }
+        }
+
+        observation.now = std::chrono::steady_clock::now();
+        TriggerReason mergeReason = policy->shouldMerge(observation);
+        if(mergeReason == TriggerReason::Deferred && lastReason != TriggerReason::Deferred) ++deferredMerges;
+        lastReason = mergeReason;
+        bool doMerge = mergeReason != TriggerReason::None && mergeReason != TriggerReason::Deferred;
+
+        // producers waiting on capacity are only let go from here, so this runs whether or not there's a merge
+        bool catchUp = false;
+        if(memoryBudget != 0) {
+            bool pendingWork = false;
+            for(int used : observation.usedChunks) pendingWork = pendingWork || used != 0;
+            if(!pendingWork) clamped = false;
+            // no merge is coming to destage what holds the memory, write it out now
+            if(!doMerge && !flushing && MemoryUsage() >= memoryBudget && MasterMerger.getItemCount() != 0)
+                WriteFromMasterMerger(mergeCount);
+            // the chunks the last merge left behind are taken as soon as there's room, whatever the policy says
+            catchUp = clamped && MemoryUsage() < memoryBudget;
+            SetBackpressure(pendingWork && (clamped || MemoryUsage() >= memoryBudget), metadata);
+        }
+
+        if(!doMerge && !flushing && !catchUp) continue;
 
         // how do we update the start chunk pointer while merging?
         //  add cleaning to the merge process (freeing of used)
         //  only merge full slots
         //  update the head in this code after merge completion
 
+        // under a memory budget, merge less at a time and destage sooner rather than growing
+        std::vector<int> mergeEndIndices = currChunkEndIndices;
+        // a flush covers everything, so it isn't held to the budget
+        clamped = !flushing && ClampToBudget(metadata, currChunkStartIndices, mergeEndIndices);
+        int stagingLimit = stagingSize;
+        if(memoryBudget != 0) {
+            uint64_t indexUsage = masterMemoryUsage;
+            uint64_t stagingRoom = memoryBudget > indexUsage ? memoryBudget - indexUsage : 0;
+            stagingLimit = std::max<uint64_t>(stagingSize / 8, std::min<uint64_t>(stagingSize, stagingRoom));
+        }
+        staging.setLimit(stagingLimit);
+
+        // for the policy's merge ratio, MergeData frees the chunks it consumes
+        uint64_t itemsIn = 0;
+        for(int i = 0; i != metadata.size(); ++i) {
+            for(int index = currChunkStartIndices[i]; index != mergeEndIndices[i]; index = (index + 1) % M_CHUNK_COUNT) {
+                if(!metadata[i][index].free) itemsIn += metadata[i][index].item_count;
+            }
+        }
+
         std::cout << "mergeThread.cpp: Merging triggered within loop.\n";
-        Merger subMerger = MergeData(metadata, data, currChunkStartIndices, currChunkEndIndices,
-                outData, curOutOffset, 131072, outFile);
+        ++mergeCount;
+        std::vector<ChunkRef> consumedChunks;
+        auto mergeStart = std::chrono::steady_clock::now();
+        bool staged = true;
+        Merger subMerger = MergeData(metadata, data, currChunkStartIndices, mergeEndIndices,
+                outData, staging, stagingLimit, DestageEarly, staged, deferFree ? &consumedChunks : nullptr);
+        if(!staged) {
+            stagingFailed = true;
+            break;
+        }
         std::cout << "mergeThread.cpp: Merging complete.\n";
         // subMerger.debugLog();
 
-        for(auto& item : subMerger.getItems()) {
-            // possibly don't merge the items here, just insert them
-            // unsure if we want to merge again before outputing
-            MasterMerger.addItemNoMerge(m_item{item.getDataOffset(), item.getBaseOffset()},
-                    outData, item.getLength());
+        if(doMerge) {
+            policy->mergeDone(mergeReason, itemsIn, subMerger.getItemCount(), std::chrono::steady_clock::now() - mergeStart);
+            if(mergeReason == TriggerReason::Threshold) ++thresholdMerges;
+            else if(mergeReason == TriggerReason::Idle) ++idleMerges;
+            else if(mergeReason == TriggerReason::Overflow) ++overflowMerges;
         }
 
-        // update head
-        metadataFileNum = 0;
-        for(const auto& chunks : metadata) {
-            auto* curStartChunk = &chunks[currChunkStartIndices[metadataFileNum]]; 
-            while(!chunks[curStartChunk->next_chunk].free) {
-                ++currChunkStartIndices[metadataFileNum];
-                currChunkStartIndices[metadataFileNum] %= M_CHUNK_COUNT;
-                curStartChunk = &chunks[currChunkStartIndices[metadataFileNum]];
-            }
-            ++metadataFileNum;
+        AddToMasterMerger(subMerger, outData);
+        for(const auto& ref : consumedChunks) {
+            chunkPending[ref.log][ref.chunk] = 1;
+            ++pendingChunkCounts[ref.log];
+        }
+        stagedChunks.insert(stagedChunks.end(), consumedChunks.begin(), consumedChunks.end());
+
+        // update head, everything up to the merge end was consumed
+        currChunkStartIndices = mergeEndIndices;
+
+        if(flushing) {
+            std::cout << "mergeThread.cpp: Flushing for ticket " << flushTicket << ".\n";
+            AddPartialChunks(metadata, data, currChunkEndIndices);
+            WriteFromMasterMerger(mergeCount);
+            SyncTarget(metadata);
+            CompleteFlush(flushTicket);
+            if(memoryBudget != 0) SetBackpressure(MemoryUsage() >= memoryBudget, metadata);
+            continue;
         }
 
         // check if we're too full
-        // if(MasterMerger.getItemCount() <= maxMasterItemCount) continue;
-        if(curOutOffset < 131072 ) continue;
-        // if so commit IO's
+        bool overBudget = memoryBudget != 0 && MemoryUsage() >= memoryBudget;
+        // the merge moved its chunks from used to pending, what's free stays the same
+        bool holdingChunks = deferFree && HoldingChunks(observation.freeChunks);
+        TriggerReason destageReason = policy->shouldDestage(DestageObservation{std::chrono::steady_clock::now(),
+                staging.getUsed(), static_cast<uint64_t>(stagingLimit), MasterMerger.getItemCount()});
+        if(destageReason == TriggerReason::Idle && !overBudget && !holdingChunks) ++idleDestages;
+        if(destageReason != TriggerReason::None || overBudget || holdingChunks) {
+            // if so commit IO's
+            WriteFromMasterMerger(mergeCount);
+        }
+        if(holdingChunks) SyncTarget(metadata);
+        MaybeSyncTarget(metadata);
+
+        if(memoryBudget != 0) SetBackpressure(clamped || MemoryUsage() >= memoryBudget, metadata);
+    }
 
-        WriteFromMasterMerger(outData, outFile);
+    if(stagingFailed) {
+        // the merged data has nowhere to go, stop rather than write it from unreserved space
+        std::cerr << "mergeThread.cpp: Unable to stage merged data, stopping the merge thread!\n";
+        DrainDestages();
+        destager.reset();
+        SetBackpressure(false, metadata);
+        return;
     }
 
     std::cout << "mergeThread.cpp: Comitting final flush merge.\n";
+    if(deferFree) {
+        // hand back every consumed chunk first, the final merge walks the whole ring
+        WriteFromMasterMerger(mergeCount);
+        SyncTarget(metadata);
+    }
+
     std::vector<int> startIndices = std::vector<int>(dataFileNames.size(), 0);
     std::vector<int> endIndices = std::vector<int>(dataFileNames.size(), M_CHUNK_COUNT);
 
+    // a flush covers everything, so it isn't held to the budget
+    staging.setLimit(stagingSize);
+    ++mergeCount;
+    std::vector<ChunkRef> consumedChunks;
+    bool staged = true;
     Merger subMerger = MergeData(metadata, data, startIndices, endIndices,
-            outData, curOutOffset, 131072, outFile);
+            outData, staging, stagingSize, DestageEarly, staged, deferFree ? &consumedChunks : nullptr);
     std::cout << "mergeThread.cpp: Merging complete.\n";
     // subMerger.debugLog();
 
-    for(auto& item : subMerger.getItems()) {
-        MasterMerger.addItemNoMerge(m_item{item.getDataOffset(), item.getBaseOffset()},
-                outData, item.getLength());
-    }
-
-    WriteFromMasterMerger(outData, outFile);
-
-    outFile.close();
-    for(const auto& chunks : metadata) munmap(chunks, M_CHUNK_COUNT * sizeof(m_chunk));
+    if(staged) AddToMasterMerger(subMerger, outData);
+    else std::cerr << "mergeThread.cpp: Unable to stage the final merge, it is not written!\n";
+    stagedChunks.insert(stagedChunks.end(), consumedChunks.begin(), consumedChunks.end());
+
+    WriteFromMasterMerger(mergeCount);
+    // the final flush covers every outstanding ticket
+    uint64_t flushTicket = requestedFlush;
+    if(deferFree || flushTicket != handledFlush) SyncTarget(metadata);
+    CompleteFlush(flushTicket);
+
+    DrainDestages();
+    destager.reset();
+    // nothing left to wait for
+    SetBackpressure(false, metadata);
+    // the mapper unmaps the logs on the way out
 }
 void MergeThread::StopMergeThread() {
     keepMerging = false;    
     MergeThread_.join();
 }
 
+void MergeThread::SetDestageWriters(int writerCount, std::vector<int> writerCpus) {
+    destageWriterCount = writerCount;
+    destageWriterCpus = std::move(writerCpus);
+}
+
+void MergeThread::SetTargetPreallocation(TargetPreallocation mode) {
+    targetPreallocation = mode;
+}
+
+void MergeThread::SetTruncateTarget(bool truncate) {
+    truncateTarget = truncate;
+}
+
+void MergeThread::SetMergePolicy(MergePolicyKind kind) {
+    mergePolicyKind = kind;
+}
+
+void MergeThread::SetMergePolicy(std::shared_ptr<MergePolicy> policy) {
+    customMergePolicy = std::move(policy);
+}
+
+MergeThread::MergeStats MergeThread::GetMergeStats() {
+    return MergeStats{mergeCount.load(), destagedMergeCount.load(), durableMergeCount.load(),
+        destageCount.load(), destagedBytes.load(),
+        thresholdMerges.load(), idleMerges.load(), overflowMerges.load(), deferredMerges.load(), idleDestages.load()};
+}
+
+void MergeThread::SetDurabilityPolicy(DurabilityPolicy policy, uint64_t param) {
+    durabilityPolicy = policy;
+    durabilityParam = param;
+}
+
+void MergeThread::RequestSync() {
+    syncRequested = true;
+}
+
+uint64_t MergeThread::FlushAsync() {
+    std::lock_guard<std::mutex> lock{flushMutex};
+    if(!flushesTaken) return 0;
+    return ++requestedFlush;
+}
+
+bool MergeThread::FlushWait(uint64_t ticket, int timeoutMs) {
+    if(ticket == 0) return false;
+    std::unique_lock<std::mutex> lock{flushMutex};
+    if(timeoutMs < 0) {
+        flushCv.wait(lock, [ticket]{ return completedFlush >= ticket; });
+        return true;
+    }
+    return flushCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [ticket]{ return completedFlush >= ticket; });
+}
+
+bool MergeThread::FlushPoll(uint64_t ticket) {
+    if(ticket == 0) return false;
+    std::lock_guard<std::mutex> lock{flushMutex};
+    return completedFlush >= ticket;
+}
+
+void MergeThread::SetMemoryBudget(uint64_t bytes) {
+    requestedMemoryBudget = bytes;
+}
+
+bool MergeThread::IsBackpressured() {
+    return backpressure;
+}
+
+bool MergeThread::WaitForCapacity(int timeoutMs) {
+    std::unique_lock<std::mutex> lock{backpressureMutex};
+    if(timeoutMs < 0) {
+        backpressureCv.wait(lock, []{ return !backpressure; });
+        return true;
+    }
+    return backpressureCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), []{ return !backpressure; });
+}
+
 void MergeThread::PauseMergeThread() {
     paused = true;
 }
@@ -260,3 +812,53 @@ extern "C" void pause_merge_thread() {
 extern "C" void unpause_merge_thread() {
     MergeThread::UnpauseMergeThread();
 }
+
+extern "C" void set_merge_memory_budget(unsigned long long bytes) {
+    MergeThread::SetMemoryBudget(bytes);
+}
+
+extern "C" int merge_backpressure() {
+    return MergeThread::IsBackpressured();
+}
+
+extern "C" int merge_wait_for_capacity(int timeoutMs) {
+    return MergeThread::WaitForCapacity(timeoutMs);
+}
+
+extern "C" void set_merge_durability(int policy, unsigned long long param) {
+    MergeThread::SetDurabilityPolicy(static_cast<MergeThread::DurabilityPolicy>(policy), param);
+}
+
+extern "C" void merge_request_sync() {
+    MergeThread::RequestSync();
+}
+
+extern "C" unsigned long long merge_flush_async() {
+    return MergeThread::FlushAsync();
+}
+
+extern "C" int merge_flush_wait(unsigned long long ticket, int timeoutMs) {
+    return MergeThread::FlushWait(ticket, timeoutMs);
+}
+
+extern "C" int merge_flush_poll(unsigned long long ticket) {
+    return MergeThread::FlushPoll(ticket);
+}
+
+extern "C" void set_merge_destage_writers(int writerCount, const int* writerCpus, int cpuCount) {
+    std::vector<int> cpus;
+    for(int i = 0; i != cpuCount; ++i) cpus.push_back(writerCpus[i]);
+    MergeThread::SetDestageWriters(writerCount, std::move(cpus));
+}
+
+extern "C" void set_merge_target_preallocation(int mode) {
+    MergeThread::SetTargetPreallocation(static_cast<MergeThread::TargetPreallocation>(mode));
+}
+
+extern "C" void set_merge_truncate_target(int truncate) {
+    MergeThread::SetTruncateTarget(truncate != 0);
+}
+
+extern "C" void set_merge_policy(int policy) {
+    MergeThread::SetMergePolicy(static_cast<MergeThread::MergePolicyKind>(policy));
+}
@@ -3,13 +3,96 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstdint>
+
+class MergePolicy;
 
 namespace MergeThread {
+    struct MergeStats {
+        uint64_t mergeCount; // merges started, a chunk is freed by the merge that consumes it
+        uint64_t destagedMergeCount; // every merge up to this one has been written to the target
+        uint64_t durableMergeCount; // and synced, same as destagedMergeCount under DurabilityPolicy::None
+        uint64_t destageCount;
+        uint64_t destagedBytes;
+        // why the merge policy merged and destaged
+        uint64_t thresholdMerges;
+        uint64_t idleMerges;
+        uint64_t overflowMerges;
+        uint64_t deferredMerges; // times a merge past the base threshold was held back
+        uint64_t idleDestages;
+    };
+
+    // when the target is synced, the values match MERGE_DURABILITY_* in merge_thread.h
+    enum class DurabilityPolicy {
+        None = 0, // never synced, chunks are freed as soon as they are merged
+        Periodic = 1, // param is the sync interval in milliseconds
+        EveryNBytes = 2, // param is the number of destaged bytes between syncs
+        OnRequest = 3 // only on RequestSync and on stop
+    };
+
+    // when to merge and destage, the values match MERGE_POLICY_* in merge_thread.h
+    enum class MergePolicyKind {
+        Fixed = 0, // merge past maxChunkInUseCount, destage when staging is nearly full or past maxMasterItemCount
+        Adaptive = 1 // follows ingest rate, idle time and merge ratio, see mergePolicy.h
+    };
+
+    // how much of the target is fallocated ahead of each destage, the values match MERGE_PREALLOCATE_*
+    enum class TargetPreallocation {
+        None = 0,
+        Extents = 1, // the ranges the destaged extents cover
+        Full = 2 // everything up to the end of the destaged extents
+    };
+
     void StartMergeThread(const std::string targetFilename,
             std::vector<std::string> metadataFileNames,
             std::vector<std::string> dataFileNames,
             const std::string outDataFilename,
             int maxChunkInUseCount, int maxMasterItemCount, int stripeSize);
+    // number of threads used to write to the target file, and optionally which cpus to pin them to
+    // takes effect on the next StartMergeThread
+    void SetDestageWriters(int writerCount, std::vector<int> writerCpus);
+    // lays the target out in as few pieces as the filesystem allows
+    // an existing target is only allocated past its current size
+    // takes effect on the next StartMergeThread
+    void SetTargetPreallocation(TargetPreallocation mode);
+    // on by default, the target starts out empty. Off merges into an existing target,
+    // only the merged extents are overwritten
+    // takes effect on the next StartMergeThread
+    void SetTruncateTarget(bool truncate);
+    // the policy is built from the StartMergeThread arguments
+    // takes effect on the next StartMergeThread
+    void SetMergePolicy(MergePolicyKind kind);
+    // use this policy instead, null goes back to the kind above
+    void SetMergePolicy(std::shared_ptr<MergePolicy> policy);
+    // bytes of extent index, sub items and staging the merge thread may hold, 0 for no limit
+    // over budget the thread merges fewer chunks at a time, destages sooner and raises backpressure
+    // takes effect on the next StartMergeThread
+    void SetMemoryBudget(uint64_t bytes);
+    // producers should hold off on filling chunks while this is set
+    bool IsBackpressured();
+    // blocks until backpressure clears, timeoutMs < 0 waits forever
+    // returns false on timeout
+    bool WaitForCapacity(int timeoutMs);
+
+    // with any policy but None, consumed chunks are only freed once their data is synced,
+    // and the durable watermark in each metadata log's control block is advanced
+    // takes effect on the next StartMergeThread
+    void SetDurabilityPolicy(DurabilityPolicy policy, uint64_t param);
+    // write out everything merged so far and sync it at the next opportunity, regardless of policy
+    // a Periodic sync covers everything merged so far the same way
+    void RequestSync();
+
+    // asks the merge thread to merge, write and sync everything written to the logs so far,
+    // without stopping it. Returns a ticket to wait on, tickets complete in order.
+    // Returns 0 if the merge thread isn't running. Tickets still outstanding when it stops are completed
+    uint64_t FlushAsync();
+    // returns false on timeout or for ticket 0, timeoutMs < 0 waits forever
+    bool FlushWait(uint64_t ticket, int timeoutMs);
+    bool FlushPoll(uint64_t ticket);
+
+    // safe to call from any thread while merging
+    MergeStats GetMergeStats();
     void PauseMergeThread();
     void UnpauseMergeThread();
     void StopMergeThread();
@@ -14,4 +14,57 @@ void pause_merge_thread();
 
 void unpause_merge_thread();
 
+// 0 for no limit, call before start_merge_thread
+void set_merge_memory_budget(unsigned long long bytes);
+
+// nonzero while the merge thread is over its memory budget and producers should hold off
+// the same flag is kept in the control block at the end of each metadata log
+int merge_backpressure();
+
+// blocks until backpressure clears or timeoutMs passes (< 0 waits forever)
+// returns nonzero if capacity is available
+int merge_wait_for_capacity(int timeoutMs);
+
+#define MERGE_DURABILITY_NONE 0
+#define MERGE_DURABILITY_PERIODIC 1 // param is the sync interval in milliseconds
+#define MERGE_DURABILITY_EVERY_N_BYTES 2 // param is the number of bytes between syncs
+#define MERGE_DURABILITY_ON_REQUEST 3
+
+// call before start_merge_thread
+void set_merge_durability(int policy, unsigned long long param);
+
+// write out everything merged so far and sync the target at the next opportunity, regardless of policy
+void merge_request_sync();
+
+// merge, write and sync everything written to the logs so far without stopping the merge thread
+// returns a ticket for merge_flush_wait/merge_flush_poll, or 0 if the merge thread isn't running
+unsigned long long merge_flush_async();
+
+// blocks until the flush is done or timeoutMs passes (< 0 waits forever)
+// returns nonzero if the flush is done, zero for ticket 0
+int merge_flush_wait(unsigned long long ticket, int timeoutMs);
+
+// nonzero if the flush is done
+int merge_flush_poll(unsigned long long ticket);
+
+// writerCpus may be null when cpuCount is 0, call before start_merge_thread
+void set_merge_destage_writers(int writerCount, const int* writerCpus, int cpuCount);
+
+#define MERGE_PREALLOCATE_NONE 0
+#define MERGE_PREALLOCATE_EXTENTS 1 // the ranges each destage covers
+#define MERGE_PREALLOCATE_FULL 2 // everything up to the end of each destage
+
+// fallocate the target ahead of each destage, call before start_merge_thread
+void set_merge_target_preallocation(int mode);
+
+// nonzero (the default) empties the target at start, zero merges into an existing target
+// call before start_merge_thread
+void set_merge_truncate_target(int truncate);
+
+#define MERGE_POLICY_FIXED 0 // merge past maxChunkInUseCount chunks in any log
+#define MERGE_POLICY_ADAPTIVE 1 // follow ingest rate, idle time and merge ratio
+
+// call before start_merge_thread
+void set_merge_policy(int policy);
+
 #endif
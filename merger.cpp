@@ -11,84 +11,72 @@
 #include <vector>
 
 #include "merger.h"
+#include "copyEngine.h"
 
-Merger MergeData(const std::vector<m_chunk*>& sourceMetadata,
-        const std::vector<void*>& sourceData,
-        const std::vector<int>& leadingChunks, const std::vector<int>& endChunks,
-        void* outData, int& curOutOffset, int maxDataSize,
-        std::ofstream& fileOut) {
+void AddLogChunks(Merger& merger, m_chunk* chunks, void* data, int logNum,
+        int leadingChunk, int endChunk, int maxDataSize,
+        std::vector<ChunkRef>* consumedChunks) {
+    auto chunkCount = endChunk - leadingChunk;
+    if(chunkCount < 0) chunkCount = (M_CHUNK_COUNT - leadingChunk) + endChunk;
 
-    Merger merger{2048};
+    /* DEBUG */
+    // std::cout << "merger.cpp: Adding items from chunks " << leadingChunk << " to " << endChunk << ", " << chunkCount << " chunks.\n";
+    // int actualChunkCount = 0;
+    /* END DEBUG */
 
-    // m-log merge
-    std::cout << "merger.cpp: Merging metadata...\n";
-    for(int i = 0; i != sourceMetadata.size(); ++i) {
-        auto& chunks = sourceMetadata[i];
-        auto& data = sourceData[i];
-        auto leadingChunk = leadingChunks[i];
-        auto endChunk = endChunks[i];
-        auto chunkCount = endChunk - leadingChunk;
-        if(chunkCount < 0) chunkCount = (M_CHUNK_COUNT - leadingChunk) + endChunk;
+    for(int j = 0; j != chunkCount; ++j) {
+        int chunkIndex = (leadingChunk + j) % M_CHUNK_COUNT;
+        auto& chunk = chunks[chunkIndex];
+        if(chunk.free) continue; //this shouldn't happen when running
 
         /* DEBUG */
-        // std::cout << "merger.cpp: Adding items from chunks " << leadingChunk << " to " << endChunk << ", " << chunkCount << " chunks.\n";
-        // int actualChunkCount = 0;
+        // ++actualChunkCount;
         /* END DEBUG */
 
-        for(int j = 0; j != chunkCount; ++j) {
-            auto& chunk = chunks[(leadingChunk + j) % M_CHUNK_COUNT];
-            if(chunk.free) continue; //this shouldn't happen when running
-
-            /* DEBUG */
-            // ++actualChunkCount;
-            /* END DEBUG */
-
-            for(int item_num = 0; item_num != chunk.item_count; ++item_num) {
-                merger.addItem(chunk.items[item_num], data, chunk.req_len, maxDataSize);
-            }
-            chunk.free = 1;
+        for(int item_num = 0; item_num != chunk.item_count; ++item_num) {
+            merger.addItem(chunk.items[item_num], data, chunk.req_len, maxDataSize);
         }
+        if(consumedChunks) consumedChunks->push_back(ChunkRef{logNum, chunkIndex});
+        else chunk.free = 1;
+    }
 
-        // std::cout << "merger.cpp: Actual chunk count for this iteration was " << actualChunkCount << '\n';
+    // std::cout << "merger.cpp: Actual chunk count for this iteration was " << actualChunkCount << '\n';
+}
+
+void AddExtents(Merger& merger, const m_extent* extents, uint64_t extentCount, void* data, int maxDataSize) {
+    for(uint64_t i = 0; i != extentCount; ++i) {
+        auto& extent = extents[i];
+        merger.addItem(m_item{extent.data_offset, extent.target_offset}, data, extent.length, maxDataSize);
     }
-    std::cout << "merger.cpp: mergeAll on " << merger.getItems().size() << " items." << std::endl;
-    merger.mergeAll(maxDataSize);
-    std::cout << "merger.cpp: Metadata merge complete.\n";
-    // merger.debugLog();
+}
 
+bool StageMergedData(Merger& merger, void* outData, StagingRing& staging,
+        const DestageFunc& destage) {
     /*
      * for each item
      *  for each log item in item
      *      copy data from data file to output data file
      */
 
+    // not worth splitting an item into pieces smaller than this, destage instead
+    uint64_t minSplitLength = staging.getLimit() / 8;
+
     std::cout << "merger.cpp: Merging data...\n";
     auto& items = merger.getItems();
-    for(auto iter = items.begin(); iter != items.end(); ++iter) {
-
-        auto& item = *iter;
-
-        // check for full buffer
-        // std::cout << "New write to " << curOutOffset << " + " << item.getLength() << " / " << maxDataSize;
-        if(curOutOffset + item.getLength() > maxDataSize) {
-            std::cout << "Buffer full, triggered early destage.\n";
-            for(auto jter = items.begin(); jter != iter; ++jter) {
-                auto& subItem = jter->getLogItems()[0];
-                fileOut.seekp(jter->getBaseOffset());
-                fileOut.write(static_cast<char*>(subItem.sourceData), jter->getLength());
-            }
-            iter = items.erase(items.begin(), iter);
-            item = *iter;
-
-            if(item.getLength() > maxDataSize) std::cout << "merger.cpp: WARNING: Large item detected.\n";
-            
-            curOutOffset = 0;
-        }
-
-        item.setDataOffset(curOutOffset);
-
+    // items move over as they're staged, so the pieces of a split item follow its head without
+    // shifting the rest. Everything before the cursor has been handed to destage
+    std::vector<MergerItem> staged;
+    staged.reserve(items.size());
+    std::size_t destageCursor = 0;
+    std::vector<CopySegment> segments;
+
+    // copies the item into its reservation and backs it by outData from there
+    auto stage = [&](MergerItem& item, uint64_t stagingOffset) {
+        item.setDataOffset(stagingOffset);
+
+        // the log items land back to back in staging, copy them in one pass
         auto& logItems = item.getLogItems();
-        int length = item.getLength() / logItems.size();
+        segments.clear();
         for(const auto& logItem : logItems) {
 
             /*
@@ -96,22 +84,85 @@ Merger MergeData(const std::vector<m_chunk*>& sourceMetadata,
                             " to " << outData << " + " << curOutOffset <<
                             ", data is " << *(static_cast<int*>(logItem.sourceData) + logItem.item.data_offset / 4) << '\n';
                             */
-            std::memcpy(static_cast<char*>(outData) + curOutOffset,
-                    static_cast<char*>(logItem.sourceData) + logItem.item.data_offset,
-                    length);
-
-            curOutOffset += length;
+            segments.push_back(CopySegment{static_cast<char*>(logItem.sourceData) + logItem.item.data_offset,
+                    logItem.length});
         }
+        CopyGather(static_cast<char*>(outData) + stagingOffset, segments.data(), segments.size());
 
         // now that all of the items are meregd, update to the new backing item
         logItems.clear(); 
-        logItems.emplace_back(TaggedItem{m_item{item.getDataOffset(), item.getBaseOffset()}, outData});
+        logItems.emplace_back(TaggedItem{m_item{item.getDataOffset(), item.getBaseOffset()}, outData, item.getLength()});
+        staged.push_back(std::move(item));
+    };
+
+    bool ok = true;
+    auto next = items.begin();
+    for(; ok && next != items.end(); ++next) {
+        // what's left of the item, a split stages its head and goes on with the rest
+        MergerItem item = std::move(*next);
+        while(true) {
+            uint64_t stagingOffset = 0;
+            if(staging.reserve(item.getLength(), stagingOffset)) {
+                stage(item, stagingOffset);
+                break;
+            }
+
+            uint64_t largestFree = staging.getLargestFree();
+            if(largestFree != 0 && (largestFree >= minSplitLength || staging.getUsed() == 0) &&
+                    staging.reserve(largestFree, stagingOffset)) {
+                // use the space there is, the rest of the item is staged after it
+                MergerItem rest = item.splitAt(largestFree);
+                stage(item, stagingOffset);
+                item = std::move(rest);
+                continue;
+            }
+
+            std::cout << "Buffer full, triggered early destage.\n";
+            destage(staged.data() + destageCursor, staged.data() + staged.size());
+            destageCursor = staged.size();
+            if(staging.getUsed() == 0 && staging.getLargestFree() == 0) {
+                // nothing will ever fit, the rest is left unstaged rather than written from unreserved space
+                std::cerr << "merger.cpp: No staging space for the item at " << item.getBaseOffset() <<
+                    " of " << item.getLength() << " bytes\n";
+                staged.push_back(std::move(item));
+                ok = false;
+                break;
+            }
+        }
     }
-    std::cout << "merger.cpp: Data merge complete.\n";
+    for(; next != items.end(); ++next) staged.push_back(std::move(*next));
+    items = std::move(staged);
+    merger.setDestagedCount(destageCursor);
+    if(ok) std::cout << "merger.cpp: Data merge complete.\n";
+    return ok;
+}
+
+Merger MergeData(const std::vector<m_chunk*>& sourceMetadata,
+        const std::vector<void*>& sourceData,
+        const std::vector<int>& leadingChunks, const std::vector<int>& endChunks,
+        void* outData, StagingRing& staging, int maxDataSize,
+        const DestageFunc& destage, bool& staged, std::vector<ChunkRef>* consumedChunks) {
+
+    Merger merger{2048};
+
+    // m-log merge
+    std::cout << "merger.cpp: Merging metadata...\n";
+    for(int i = 0; i != sourceMetadata.size(); ++i) {
+        AddLogChunks(merger, sourceMetadata[i], sourceData[i], i,
+                leadingChunks[i], endChunks[i], maxDataSize, consumedChunks);
+    }
+    std::cout << "merger.cpp: mergeAll on " << merger.getItems().size() << " items." << std::endl;
+    merger.mergeAll(maxDataSize);
+    std::cout << "merger.cpp: Metadata merge complete.\n";
+    // merger.debugLog();
+
+    staged = StageMergedData(merger, outData, staging, destage);
     return merger;
 }
 
-Merger::Merger(std::size_t initialBackingSize) {
+Merger::Merger(std::size_t initialBackingSize) :
+    destagedCount{0}
+{
     items.reserve(initialBackingSize);
 }
 
@@ -167,6 +218,15 @@ void Merger::mergeAll(int maxSize) {
 
 void Merger::clear() {
     items.clear();
+    destagedCount = 0;
+}
+
+std::size_t Merger::getDestagedCount() const {
+    return destagedCount;
+}
+
+void Merger::setDestagedCount(std::size_t count) {
+    destagedCount = count;
 }
 
 void Merger::debugLog() const {
@@ -179,6 +239,7 @@ void Merger::debugLog() const {
         std::cout << "]\nSub Items [\n";
         for(const auto& subItem : currItem.getLogItems()) {
             std::cout << "\tSource Offset: " << subItem.item.data_offset << '\n';
+            std::cout << "\tLength: " << subItem.length << '\n';
             std::cout << "\tTarget Offset: " << subItem.item.target_offset << '\n';
             std::cout << "\tSource Data: " << subItem.sourceData << '\n';
         }
@@ -190,6 +251,12 @@ size_t Merger::getItemCount() const {
     return items.size();
 }
 
+std::size_t Merger::getMemoryUsage() const {
+    std::size_t usage = items.size() * sizeof(MergerItem);
+    for(const auto& item : items) usage += item.getLogItems().size() * sizeof(TaggedItem);
+    return usage;
+}
+
 const std::vector<MergerItem>& Merger::getItems() const {
     return items;
 }
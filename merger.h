@@ -3,8 +3,10 @@
 
 #include <cstring>
 #include <vector>
-#include <fstream>
+#include <functional>
 #include "mergerItem.h"
+#include "mExtent.h"
+#include "stagingRing.h"
 
 class Merger {
 public:
@@ -15,20 +17,59 @@ public:
     void mergeAll(int maxSize);
     void clear();
 
+    // items before this index have already been written out by an early destage
+    std::size_t getDestagedCount() const;
+    void setDestagedCount(std::size_t count);
+
     void debugLog() const;
     std::size_t getItemCount() const;
+    // bytes held by the extent index and the sub items of each extent
+    std::size_t getMemoryUsage() const;
     const std::vector<MergerItem>& getItems() const;
     std::vector<MergerItem>& getItems();
 
 private:
     std::vector<MergerItem> items;
+    std::size_t destagedCount;
+};
+
+// a chunk by the log it came from and its index in that log's ring
+struct ChunkRef {
+    int log;
+    int chunk;
 };
 
-// returns the newly merged merger
+// writes [first, last) out of the staging buffer, along with anything else the caller has staged
+// that needs to go out first. The writes may still be in flight on return, but some staging space
+// has to have been released by then unless nothing is left to write
+using DestageFunc = std::function<void(const MergerItem* first, const MergerItem* last)>;
+
+// adds every item in chunks [leadingChunk, endChunk) of one log, freeing them as MergeData does
+void AddLogChunks(Merger& merger, m_chunk* chunks, void* data, int logNum,
+        int leadingChunk, int endChunk, int maxDataSize,
+        std::vector<ChunkRef>* consumedChunks);
+
+// adds the extents an earlier merge stage wrote, data_offset indexes into data
+// Extents still only merge up to maxDataSize, like log items, so each level of a cascade
+// can't coalesce past it and its index holds at least one extent per maxDataSize of data
+void AddExtents(Merger& merger, const m_extent* extents, uint64_t extentCount, void* data, int maxDataSize);
+
+// copies the data of each merged item into space reserved from staging in outData,
+// afterwards each item has a single log item backed by outData at its reservation.
+// Items larger than the free space are split, and when there's too little space to
+// be worth splitting into, the items staged so far are handed to destage.
+// Items before getDestagedCount() have been destaged, the rest are still reserved.
+// Returns false if an item can't be staged at all, as with a ring limited to nothing,
+// that item and the ones after it are left as merged, without staging.
+bool StageMergedData(Merger& merger, void* outData, StagingRing& staging,
+        const DestageFunc& destage);
+
+// returns the newly merged merger, staged as StageMergedData does, staged is set to what it returned
+// consumed chunks are marked free, unless consumedChunks is given, then they are left to the caller
 Merger MergeData(const std::vector<m_chunk*>& sourceMetadata,
         const std::vector<void*>& sourceData,
         const std::vector<int>& leadingChunks, const std::vector<int>& endChunks,
-        void* outData, int& curOutOffset, int maxDataSize,
-        std::ofstream& fileOut);
+        void* outData, StagingRing& staging, int maxDataSize,
+        const DestageFunc& destage, bool& staged, std::vector<ChunkRef>* consumedChunks = nullptr);
 
 #endif
@@ -11,7 +11,7 @@ bool TaggedItem::operator<(const TaggedItem& other) const {
 MergerItem::MergerItem(const m_item& startingItem, void* sourceData, uint64_t length_) :
     length{length_},
     offset{startingItem.target_offset},
-    items{TaggedItem{startingItem, sourceData}}
+    items{TaggedItem{startingItem, sourceData, length_}}
 {}
 
 bool MergerItem::operator<(const MergerItem& other) const {
@@ -56,6 +56,31 @@ void MergerItem::merge(const MergerItem& other) {
     */
 }
 
+MergerItem MergerItem::splitAt(uint64_t splitLength) {
+    uint64_t splitOffset = offset + splitLength;
+
+    std::vector<TaggedItem> headItems;
+    std::vector<TaggedItem> tailItems;
+    for(const auto& logItem : items) {
+        uint64_t logItemEnd = logItem.item.target_offset + logItem.length;
+        if(logItemEnd <= splitOffset) headItems.push_back(logItem);
+        else if(logItem.item.target_offset >= splitOffset) tailItems.push_back(logItem);
+        else {
+            uint64_t headLength = splitOffset - logItem.item.target_offset;
+            headItems.push_back(TaggedItem{logItem.item, logItem.sourceData, headLength});
+            tailItems.push_back(TaggedItem{m_item{logItem.item.data_offset + headLength, splitOffset},
+                    logItem.sourceData, logItem.length - headLength});
+        }
+    }
+
+    MergerItem tail{tailItems[0].item, tailItems[0].sourceData, length - splitLength};
+    tail.items = std::move(tailItems);
+
+    items = std::move(headItems);
+    length = splitLength;
+    return tail;
+}
+
 uint64_t MergerItem::getBaseOffset() const {
     return offset;
 }
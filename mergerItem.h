@@ -11,6 +11,7 @@
 struct TaggedItem {
     m_item item;
     void* sourceData;
+    uint64_t length;
 
     bool operator<(const TaggedItem& other) const;
 };
@@ -39,6 +40,10 @@ public:
 
     void merge(const MergerItem& other);
 
+    // keeps the first splitLength bytes and returns an item for the rest
+    // a log item crossing the split is cut in two
+    MergerItem splitAt(uint64_t splitLength);
+
     uint64_t getBaseOffset() const;
     void setBaseOffset(uint64_t offset);
 
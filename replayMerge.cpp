@@ -0,0 +1,335 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "mTrace.h"
+#include "mergeThread.h"
+
+using Clock = std::chrono::steady_clock;
+
+// trace records applied to a chunk that the merge thread hasn't consumed yet
+struct PendingChunk {
+    std::vector<Clock::time_point> applyTimes;
+    uint64_t freedByMerge;
+};
+
+static void* createFile(const std::string& filename, uint64_t size) {
+    int file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(file < 0) {
+        std::cerr << "Error opening file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+    if(ftruncate(file, size) != 0) perror("Error:");
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+    if(data == MAP_FAILED) {
+        std::cerr << "Error mapping file \"" << filename << "\"\n";
+        perror("Error:");
+        return nullptr;
+    }
+    return data;
+}
+
+static double toMs(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/*
+ * Feeds a trace recorded by captureLogs back into the merge thread, either at the
+ * original speed or as fast as possible, and reports throughput, time spent
+ * waiting on full rings and how long it takes for ingested chunks to reach the target.
+ */
+int main(int argc, char** argv) {
+
+    std::string traceFile;
+    std::string workDir = ".";
+    std::string targetFile;
+
+    bool asFastAsPossible = false;
+    int maxChunkInUseCount = M_CHUNK_COUNT / 2;
+    int maxMasterItemCount = 2048;
+    int destageWriters = 1;
+    int stallTimeoutMs = 10000;
+    uint64_t memoryBudget = 0;
+    int durabilityPolicy = 0;
+    uint64_t durabilityParam = 0;
+    int preallocate = 0;
+    int mergePolicy = 0;
+    bool truncateTarget = true;
+
+    std::string activeFlag = "";
+    for(int argNum = 0; argNum != argc; ++argNum) {
+        std::string currArg{argv[argNum]};
+        if(currArg == "--asFastAsPossible") asFastAsPossible = true;
+        else if(currArg == "--noTruncate") truncateTarget = false;
+        else if(currArg[0] == '-') activeFlag = currArg;
+        else if(activeFlag == "--traceFile") {
+            traceFile = std::move(currArg);
+        }
+        else if(activeFlag == "--workDir") {
+            workDir = std::move(currArg);
+        }
+        else if(activeFlag == "--targetFile") {
+            targetFile = std::move(currArg);
+        }
+        else if(activeFlag == "--maxChunkInUseCount") {
+            maxChunkInUseCount = std::stoi(currArg);
+        }
+        else if(activeFlag == "--maxMasterItemCount") {
+            maxMasterItemCount = std::stoi(currArg);
+        }
+        else if(activeFlag == "--destageWriters") {
+            destageWriters = std::stoi(currArg);
+        }
+        else if(activeFlag == "--stallTimeoutMs") {
+            stallTimeoutMs = std::stoi(currArg);
+        }
+        else if(activeFlag == "--memoryBudget") {
+            memoryBudget = std::stoull(currArg);
+        }
+        else if(activeFlag == "--durability") {
+            if(currArg == "periodic") durabilityPolicy = 1;
+            else if(currArg == "bytes") durabilityPolicy = 2;
+            else if(currArg == "request") durabilityPolicy = 3;
+            else durabilityPolicy = 0;
+        }
+        else if(activeFlag == "--durabilityParam") {
+            durabilityParam = std::stoull(currArg);
+        }
+        else if(activeFlag == "--mergePolicy") {
+            mergePolicy = currArg == "adaptive" ? 1 : 0;
+        }
+        else if(activeFlag == "--preallocate") {
+            if(currArg == "extents") preallocate = 1;
+            else if(currArg == "full") preallocate = 2;
+            else preallocate = 0;
+        }
+    }
+
+    if(traceFile == "") {
+        std::cerr << "Usage: replayMerge --traceFile <file> [--workDir <dir>] [--targetFile <file>] [--asFastAsPossible]\n" <<
+            "\t[--maxChunkInUseCount <n>] [--maxMasterItemCount <n>] [--destageWriters <n>] [--stallTimeoutMs <ms>]\n" <<
+            "\t[--memoryBudget <bytes>] [--durability none|periodic|bytes|request] [--durabilityParam <ms or bytes>]\n" <<
+            "\t[--preallocate none|extents|full] [--noTruncate] [--mergePolicy fixed|adaptive]\n";
+        return 1;
+    }
+    if(targetFile == "") targetFile = workDir + "/replay-target";
+
+    std::ifstream trace{traceFile, std::ios::binary};
+    m_trace_header header{};
+    trace.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!trace.good() || header.magic != M_TRACE_MAGIC || header.version != M_TRACE_VERSION) {
+        std::cerr << "\"" << traceFile << "\" is not a merge trace\n";
+        return 1;
+    }
+    bool hasData = header.flags & M_TRACE_FLAG_DATA;
+
+    // the merge thread maps every log with the metadata ring size, the data logs have to cover that too
+    uint64_t dataLogSize = std::max<uint64_t>(header.data_log_size, M_CHUNK_COUNT * sizeof(m_chunk));
+
+    std::vector<std::string> metadataFiles;
+    std::vector<std::string> dataFiles;
+    std::vector<m_chunk*> metadata;
+    std::vector<char*> data;
+    for(int logNum = 0; logNum != header.log_count; ++logNum) {
+        metadataFiles.push_back(workDir + "/replay-metadata-log-" + std::to_string(logNum));
+        dataFiles.push_back(workDir + "/replay-data-log-" + std::to_string(logNum));
+
+        auto* chunks = static_cast<m_chunk*>(createFile(metadataFiles.back(), M_METADATA_SIZE));
+        auto* logData = static_cast<char*>(createFile(dataFiles.back(), dataLogSize));
+        if(chunks == nullptr || logData == nullptr) return 1;
+
+        for(int i = 0; i != M_CHUNK_COUNT; ++i) {
+            chunks[i] = m_chunk{static_cast<uint64_t>(i + 1), 1, 0, 0, 0, 0, {}};
+        }
+        chunks[M_CHUNK_COUNT - 1].next_chunk = 0;
+
+        metadata.push_back(chunks);
+        data.push_back(logData);
+    }
+    std::string outDataFile = workDir + "/replay-out-data";
+    if(createFile(outDataFile, M_CHUNK_COUNT * sizeof(m_chunk)) == nullptr) return 1;
+
+    std::vector<std::vector<PendingChunk>> pending = std::vector<std::vector<PendingChunk>>(header.log_count,
+            std::vector<PendingChunk>(M_CHUNK_COUNT));
+    std::vector<PendingChunk> awaitingDestage;
+    std::vector<double> latenciesMs;
+
+    // a freed chunk was consumed by a merge no later than the current count, wait for that one
+    auto retireChunk = [&](PendingChunk& pendingChunk, uint64_t mergeCount) {
+        if(pendingChunk.applyTimes.empty()) return;
+        pendingChunk.freedByMerge = mergeCount;
+        awaitingDestage.push_back(std::move(pendingChunk));
+        pendingChunk.applyTimes.clear();
+    };
+
+    // moves chunks the merge thread has freed over to waiting on a destage,
+    // and records the latency of everything whose merge has been destaged.
+    // Completion is only noticed here, so latencies are accurate to the check interval
+    auto checkDurable = [&](bool checkChunks) {
+        auto stats = MergeThread::GetMergeStats();
+        auto now = Clock::now();
+        if(checkChunks) {
+            for(int logNum = 0; logNum != pending.size(); ++logNum) {
+                for(int chunkNum = 0; chunkNum != M_CHUNK_COUNT; ++chunkNum) {
+                    if(metadata[logNum][chunkNum].free) retireChunk(pending[logNum][chunkNum], stats.mergeCount);
+                }
+            }
+        }
+        for(auto iter = awaitingDestage.begin(); iter != awaitingDestage.end();) {
+            if(iter->freedByMerge > stats.durableMergeCount) {
+                ++iter;
+                continue;
+            }
+            for(auto applyTime : iter->applyTimes) latenciesMs.push_back(toMs(now - applyTime));
+            iter = awaitingDestage.erase(iter);
+        }
+    };
+
+    std::cout << "Replaying " << header.log_count << " logs from \"" << traceFile << "\"" <<
+        (asFastAsPossible ? " as fast as possible" : " at original speed") << "...\n";
+
+    auto startStats = MergeThread::GetMergeStats();
+    MergeThread::SetDestageWriters(destageWriters, {});
+    MergeThread::SetMemoryBudget(memoryBudget);
+    MergeThread::SetDurabilityPolicy(static_cast<MergeThread::DurabilityPolicy>(durabilityPolicy), durabilityParam);
+    MergeThread::SetTargetPreallocation(static_cast<MergeThread::TargetPreallocation>(preallocate));
+    MergeThread::SetTruncateTarget(truncateTarget);
+    MergeThread::SetMergePolicy(static_cast<MergeThread::MergePolicyKind>(mergePolicy));
+    MergeThread::StartMergeThread(targetFile, metadataFiles, dataFiles, outDataFile,
+            maxChunkInUseCount, maxMasterItemCount, 0);
+
+    uint64_t recordCount = 0;
+    uint64_t ingestedBytes = 0;
+    uint64_t stallCount = 0;
+    uint64_t forcedCount = 0;
+    Clock::duration stallTime{0};
+    auto start = Clock::now();
+    auto lastCheck = start;
+    std::vector<char> recordData;
+
+    m_trace_record record{};
+    while(trace.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        if(record.log >= header.log_count || record.chunk_index >= M_CHUNK_COUNT ||
+                record.chunk.item_count > M_ITEM_COUNT || record.first_item > record.chunk.item_count) {
+            std::cerr << "Corrupt trace record " << recordCount << ", stopping.\n";
+            break;
+        }
+
+        auto newItemCount = record.chunk.item_count - record.first_item;
+        if(hasData) {
+            recordData.resize(newItemCount * record.chunk.req_len);
+            trace.read(recordData.data(), recordData.size());
+        }
+
+        if(!asFastAsPossible) std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.timestamp_ns));
+
+        auto& chunk = metadata[record.log][record.chunk_index];
+
+        // the application would have had to wait for the merge thread to free this chunk
+        if(record.new_chunk && !chunk.free) {
+            ++stallCount;
+            auto stallStart = Clock::now();
+            while(!chunk.free && Clock::now() - stallStart < std::chrono::milliseconds(stallTimeoutMs)) {
+                std::this_thread::yield();
+            }
+            if(!chunk.free) ++forcedCount;
+            stallTime += Clock::now() - stallStart;
+            checkDurable(true);
+        }
+
+        // the chunk may have been freed and is about to be refilled before the last check saw it,
+        // its earlier records belong to the merge that freed it and not to the next one
+        if(chunk.free) retireChunk(pending[record.log][record.chunk_index], MergeThread::GetMergeStats().mergeCount);
+
+        for(int itemNum = record.first_item; itemNum != record.chunk.item_count; ++itemNum) {
+            auto& item = record.chunk.items[itemNum];
+            if(hasData && item.data_offset + record.chunk.req_len <= dataLogSize) {
+                std::memcpy(data[record.log] + item.data_offset,
+                        recordData.data() + (itemNum - record.first_item) * record.chunk.req_len,
+                        record.chunk.req_len);
+            }
+            ingestedBytes += record.chunk.req_len;
+        }
+
+        // fill in the chunk before handing it over, the merge thread only looks at it once free is cleared
+        chunk.stride = record.chunk.stride;
+        chunk.req_len = record.chunk.req_len;
+        chunk.st_offset = record.chunk.st_offset;
+        std::memcpy(chunk.items, record.chunk.items, sizeof(chunk.items));
+        chunk.item_count = record.chunk.item_count;
+        std::atomic_thread_fence(std::memory_order_release);
+        chunk.free = 0;
+
+        pending[record.log][record.chunk_index].applyTimes.push_back(Clock::now());
+        ++recordCount;
+
+        if(Clock::now() - lastCheck > std::chrono::milliseconds(1)) {
+            checkDurable(true);
+            lastCheck = Clock::now();
+        }
+    }
+    auto ingestEnd = Clock::now();
+
+    // the final flush consumes every chunk that is left
+    MergeThread::StopMergeThread();
+    auto end = Clock::now();
+    for(auto& logPending : pending) {
+        for(auto& pendingChunk : logPending) {
+            if(pendingChunk.applyTimes.empty()) continue;
+            awaitingDestage.push_back(std::move(pendingChunk));
+        }
+    }
+    for(auto& pendingChunk : awaitingDestage) {
+        for(auto applyTime : pendingChunk.applyTimes) latenciesMs.push_back(toMs(end - applyTime));
+    }
+
+    auto endStats = MergeThread::GetMergeStats();
+    uint64_t destagedBytes = endStats.destagedBytes - startStats.destagedBytes;
+    double ingestS = std::chrono::duration<double>(ingestEnd - start).count();
+    double totalS = std::chrono::duration<double>(end - start).count();
+
+    std::sort(latenciesMs.begin(), latenciesMs.end());
+    auto percentile = [&](double p) {
+        if(latenciesMs.empty()) return 0.0;
+        return latenciesMs[static_cast<std::size_t>(p * (latenciesMs.size() - 1))];
+    };
+    double meanMs = 0;
+    for(auto latency : latenciesMs) meanMs += latency;
+    if(!latenciesMs.empty()) meanMs /= latenciesMs.size();
+
+    std::cout << "Replay complete.\n";
+    std::cout << "records: " << recordCount << '\n';
+    std::cout << "ingested bytes: " << ingestedBytes << '\n';
+    std::cout << "ingest time: " << ingestS << " s\n";
+    std::cout << "total time (including final flush): " << totalS << " s\n";
+    std::cout << "ingest throughput: " << (ingestS > 0 ? ingestedBytes / ingestS / 1e6 : 0) << " MB/s\n";
+    std::cout << "end-to-end throughput: " << (totalS > 0 ? ingestedBytes / totalS / 1e6 : 0) << " MB/s\n";
+    std::cout << "merges: " << endStats.mergeCount - startStats.mergeCount <<
+        ", destages: " << endStats.destageCount - startStats.destageCount <<
+        ", destaged bytes: " << destagedBytes << '\n';
+    std::cout << "merge triggers: threshold " << endStats.thresholdMerges - startStats.thresholdMerges <<
+        ", idle " << endStats.idleMerges - startStats.idleMerges <<
+        ", overflow " << endStats.overflowMerges - startStats.overflowMerges <<
+        ", deferred " << endStats.deferredMerges - startStats.deferredMerges <<
+        ", idle destages " << endStats.idleDestages - startStats.idleDestages << '\n';
+    std::cout << "ring-full stalls: " << stallCount << ", stall time: " << toMs(stallTime) << " ms" <<
+        ", timed out: " << forcedCount << '\n';
+    // without a durability policy nothing is synced, so this is as far as a record gets
+    std::cout << (durabilityPolicy == 0 ? "ingest-to-destage" : "ingest-to-durable") <<
+        " latency (ms): min " << percentile(0) << ", mean " << meanMs <<
+        ", p50 " << percentile(0.5) << ", p99 " << percentile(0.99) << ", max " << percentile(1) << '\n';
+    return 0;
+}
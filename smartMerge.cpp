@@ -2,50 +2,262 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
-#include <filesystem>
 #include <algorithm>
+#include <cmath>
+#include <thread>
 
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "merger.h"
+#include "logMapper.h"
+#include "targetFile.h"
+#include "copyEngine.h"
 
-static void* mapFile(const std::string& filename, int size, bool trunc) {
+// a raw metadata/data log pair, or the output of an earlier merge stage and its extent index
+struct MergeInput {
+    std::string metadataFile; // metadata ring or extent index
+    std::string dataFile;
+    bool isIndex;
+    uint64_t dataSize;
+    std::size_t mappedLog; // raw logs are mapped ahead of time by the LogMapper
+};
+
+// how a stage lays out the file it writes
+struct StageLayout {
+    Preallocation preallocate;
+    bool punchHoles; // keep the gaps between extents sparse after a Full preallocation
+    bool truncate; // off to merge into an existing target, only the extents are overwritten
+};
+
+static const std::string indexSuffix = ".merged-index";
+
+// without trunc the file has to hold size bytes already, touching a page past its end would SIGBUS
+// returns nullptr if it can't be mapped
+static void* mapFile(const std::string& filename, std::size_t size, bool trunc) {
     int flags = O_RDWR;
     if(trunc) flags |= O_CREAT | O_TRUNC;
     int file = open(filename.c_str(), flags, 0666);
     if(file < 0) {
         std::cerr << "Error opening file \"" << filename << "\"\n";
         perror("Error:");
+        return nullptr;
+    }
+    struct stat fileStat;
+    if(trunc ? ftruncate(file, size) != 0 : fstat(file, &fileStat) != 0) {
+        std::cerr << "Error sizing file \"" << filename << "\"\n";
+        perror("Error:");
+        close(file);
+        return nullptr;
+    }
+    if(!trunc && static_cast<uint64_t>(fileStat.st_size) < size) {
+        std::cerr << "File \"" << filename << "\" holds " << fileStat.st_size << " bytes, expected " << size << '\n';
+        close(file);
+        return nullptr;
     }
-    if(trunc) ftruncate(file, size);
     void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
     if(data == MAP_FAILED) {
         std::cerr << "Error mapping file \"" << filename << "\"\n";
         perror("Error:");
+        return nullptr;
     }
-    close(file);
     return data;
 }
 
+static bool hasSuffix(const std::string& filename, const std::string& suffix) {
+    return filename.size() > suffix.size() &&
+        filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// one pass over the directory entries, raw logs plus the outputs of earlier merges that left an index behind
+// only entries without a type and symlinks are stat'ed here, the LogMapper does the rest while mapping
+static bool ListBufferFolder(int dirFd, std::vector<std::string>& metadataFiles,
+        std::vector<std::string>& dataFiles, std::vector<std::string>& indexFiles) {
+    std::vector<std::string> filenames;
+    if(!ListRegularFiles(dirFd, filenames)) return false;
+
+    for(const auto& filename : filenames) {
+        if(hasSuffix(filename, indexSuffix)) indexFiles.push_back(filename);
+        else if(filename.find("metadata-log") != std::string::npos &&
+                filename.find("merged") == std::string::npos) metadataFiles.push_back(filename);
+        else if (filename.find("data-log") != std::string::npos &&
+                filename.find("merged") == std::string::npos) dataFiles.push_back(filename);
+    }
+
+    std::sort(metadataFiles.begin(), metadataFiles.end());
+    std::sort(dataFiles.begin(), dataFiles.end());
+    std::sort(indexFiles.begin(), indexFiles.end());
+    return true;
+}
+
+static bool readIndex(const std::string& filename, m_extent_header& header, std::vector<m_extent>& extents) {
+    std::ifstream in{filename, std::ios::binary};
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!in.good() || header.magic != M_EXTENT_MAGIC || header.version != M_EXTENT_VERSION) {
+        std::cerr << "\"" << filename << "\" is not a merged extent index\n";
+        return false;
+    }
+    extents.resize(header.extent_count);
+    in.read(reinterpret_cast<char*>(extents.data()), extents.size() * sizeof(m_extent));
+    return in.good() || extents.empty();
+}
+
+static bool writeIndex(const std::string& filename, const std::vector<m_extent>& extents) {
+    uint64_t dataSize = 0;
+    for(const auto& extent : extents) dataSize = std::max(dataSize, extent.data_offset + extent.length);
+
+    std::ofstream out{filename, std::ios::binary};
+    if(!out.good()) {
+        std::cerr << "Unable to open index file \"" << filename << "\"\n";
+        return false;
+    }
+    m_extent_header header{M_EXTENT_MAGIC, M_EXTENT_VERSION, extents.size(), dataSize};
+    out.write(reinterpret_cast<char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(extents.data()), extents.size() * sizeof(m_extent));
+    return out.good();
+}
+
+// enough levels that each stage only opens a handful of inputs, without mapping more than
+// maxStageBytes of input data in one stage
+static int ChooseFanIn(const std::vector<MergeInput>& inputs, uint64_t maxStageBytes) {
+    uint64_t totalBytes = 0;
+    for(const auto& input : inputs) totalBytes += input.dataSize;
+
+    int fanIn = std::max(2, static_cast<int>(std::ceil(std::sqrt(inputs.size()))));
+    uint64_t bytesPerInput = inputs.empty() ? 0 : totalBytes / inputs.size();
+    if(bytesPerInput != 0) fanIn = std::min<uint64_t>(fanIn, std::max<uint64_t>(2, maxStageBytes / bytesPerInput));
+    return fanIn;
+}
+
+/*
+ * Merges the inputs into outFile, writing each merged extent at its target offset,
+ * and fills written with the extents that were written. Since the data sits at its target offset,
+ * outFile together with those extents can be the input of the next stage.
+ * The merged extents are known before any data is written, so outFile is laid out from them first.
+ * Returns false if any of the merged data couldn't be staged or written, only what was written is in written.
+ */
+static bool MergeStage(const std::vector<MergeInput>& inputs, const std::string& outFile,
+        void* outData, int maxDataSize, LogMapper& mapper, const StageLayout& layout,
+        std::vector<m_extent>& written) {
+
+    int out = open(outFile.c_str(), O_WRONLY | O_CREAT | (layout.truncate ? O_TRUNC : 0), 0666);
+    if(out < 0) {
+        std::cerr << "Unable to open out file \"" << outFile << "\"\n";
+        return false;
+    }
+
+    StagingRing staging{static_cast<uint64_t>(maxDataSize)};
+    bool writeFailed = false;
+    auto destage = [&](const MergerItem* first, const MergerItem* last) {
+        for(auto* item = first; item != last; ++item) {
+            auto& logItem = item->getLogItems()[0];
+            if(WriteTarget(out, static_cast<char*>(outData) + logItem.item.data_offset, item->getLength(),
+                        logItem.item.target_offset)) {
+                written.push_back(m_extent{item->getBaseOffset(), item->getBaseOffset(), item->getLength()});
+            }
+            else writeFailed = true;
+            staging.release(logItem.item.data_offset);
+        }
+    };
+
+    std::vector<std::pair<void*, uint64_t>> mappings;
+    Merger merger{2048};
+
+    std::cout << "Merging metadata of " << inputs.size() << " inputs into \"" << outFile << "\"...\n";
+    int skipped = 0;
+    // raw logs are taken as soon as each one is mapped, later ones may still be mapping
+    for(int i = 0; i != inputs.size(); ++i) {
+        auto& input = inputs[i];
+        if(input.isIndex) {
+            m_extent_header header;
+            std::vector<m_extent> extents;
+            if(!readIndex(input.metadataFile, header, extents)) continue;
+            if(header.data_size == 0) continue;
+
+            void* data = mapFile(input.dataFile, header.data_size, false);
+            if(data == nullptr) {
+                std::cerr << "Skipping \"" << input.metadataFile << "\", its data can't be mapped\n";
+                continue;
+            }
+            mappings.emplace_back(data, header.data_size);
+            AddExtents(merger, extents.data(), extents.size(), data, maxDataSize);
+        }
+        else {
+            const MappedLog& log = mapper.get(input.mappedLog);
+            if(!log.ok) continue;
+            if(!log.live) {
+                ++skipped;
+                continue;
+            }
+            AddLogChunks(merger, log.metadata, log.data, i, 0, M_CHUNK_COUNT, maxDataSize, nullptr);
+        }
+    }
+    if(skipped != 0) std::cout << "Skipped " << skipped << " logs with empty rings.\n";
+    merger.mergeAll(maxDataSize);
+
+    auto& mergedItems = merger.getItems();
+    std::vector<TargetRange> covered = CoveredRanges(mergedItems.data(), mergedItems.data() + mergedItems.size());
+    if(!PreallocateTarget(out, covered, layout.preallocate)) {
+        std::cerr << "Unable to preallocate \"" << outFile << "\", leaving it to the writes\n";
+    }
+    // the gaps of an existing target may hold data from earlier merges
+    else if(layout.punchHoles && layout.truncate && !PunchGaps(out, covered)) {
+        std::cerr << "Unable to punch holes in \"" << outFile << "\"\n";
+    }
+
+    bool staged = StageMergedData(merger, outData, staging, destage);
+    // merger.debugLog();
+
+    // do final write, of whatever wasn't destaged early
+    auto& items = merger.getItems();
+    if(staged) destage(items.data() + merger.getDestagedCount(), items.data() + items.size());
+    else std::cerr << "Unable to stage the merged data of \"" << outFile << "\"\n";
+    if(writeFailed) std::cerr << "Unable to write all of the merged data to \"" << outFile << "\"\n";
+    close(out);
+
+    for(auto& mapping : mappings) munmap(mapping.first, mapping.second);
+    for(const auto& input : inputs) {
+        if(!input.isIndex) mapper.release(input.mappedLog);
+    }
+    return staged && !writeFailed;
+}
+
 int main(int argc, char** argv) {
 
     std::string bufferFolder;
 
     std::string outDataFile;
     std::string outMetadataFile;
+    std::string outIndexFile;
 
     std::string outFile;
 
     int maxDataSize = 131072;
 
+    bool cascade = false;
+    bool keepIntermediate = false;
+    int fanIn = 0; // 0 picks one from the inputs
+    uint64_t maxStageBytes = 1ull << 30;
+    int mapThreads = std::min(16u, std::max(1u, std::thread::hardware_concurrency()));
+    // --noTruncate, a full --preallocate and --punchHoles only apply to the final output, intermediate outputs
+    // are always fresh and only get their extents
+    StageLayout layout{Preallocation::None, false, true};
+
     std::string activeFlag = "";
     for(int argNum = 0; argNum != argc; ++argNum) {
         std::string currArg{argv[argNum]};
-        if(currArg[0] == '-') activeFlag = currArg;
+        if(currArg == "--cascade") cascade = true;
+        else if(currArg == "--punchHoles") layout.punchHoles = true;
+        else if(currArg == "--noTruncate") layout.truncate = false;
+        else if(currArg == "--keepIntermediate") keepIntermediate = true;
+        else if(currArg[0] == '-') activeFlag = currArg;
         else if(activeFlag == "--bufferFolder") {
             bufferFolder = std::move(currArg);
         }
@@ -55,76 +267,125 @@ int main(int argc, char** argv) {
         else if (activeFlag == "--outMetadataFile") {
             outMetadataFile = std::move(currArg);
         }
+        else if (activeFlag == "--outIndexFile") {
+            outIndexFile = std::move(currArg);
+        }
         else if (activeFlag == "--outFile") {
             outFile = std::move(currArg);
         }
         else if(activeFlag == "--maxDataSize") {
             maxDataSize = std::stoi(currArg);
         }
+        else if(activeFlag == "--fanIn") {
+            fanIn = std::stoi(currArg);
+            cascade = true;
+        }
+        else if(activeFlag == "--maxStageBytes") {
+            maxStageBytes = std::stoull(currArg);
+        }
+        else if(activeFlag == "--preallocate") {
+            if(currArg == "extents") layout.preallocate = Preallocation::Extents;
+            else if(currArg == "full") layout.preallocate = Preallocation::Full;
+            else layout.preallocate = Preallocation::None;
+        }
+        else if(activeFlag == "--mapThreads") {
+            mapThreads = std::stoi(currArg);
+        }
     }
 
     std::vector<std::string> metadataFiles;
     std::vector<std::string> dataFiles;
+    std::vector<std::string> indexFiles;
 
-    namespace fs = std::filesystem;
-    for(const auto& dirent : fs::directory_iterator(bufferFolder)) {
-        std::string filename = dirent.path().filename();
-        if(filename.find("metadata-log") != std::string::npos &&
-                filename.find("merged") == std::string::npos) metadataFiles.push_back(dirent.path());
-        else if (filename.find("data-log") != std::string::npos &&
-                filename.find("merged") == std::string::npos) dataFiles.push_back(dirent.path());
-    }
+    // raw logs are opened relative to the buffer folder, empty ones are never mapped past their metadata
+    LogMapper mapper{mapThreads, bufferFolder, false, true};
+    if(mapper.getDirectoryFd() < 0 ||
+            !ListBufferFolder(mapper.getDirectoryFd(), metadataFiles, dataFiles, indexFiles)) return 1;
 
-    std::sort(metadataFiles.begin(), metadataFiles.end());
-    std::sort(dataFiles.begin(), dataFiles.end());
-    
     std::cout << "bufferFolder: " << bufferFolder << '\n';
     std::cout << "metadataFiles: ";
     for (auto& file : metadataFiles) std::cout << file << ", ";
     std::cout << "\ndataFiles: ";
     for (auto& file : dataFiles) std::cout << file << ", ";
+    std::cout << "\nindexFiles: ";
+    for (auto& file : indexFiles) std::cout << file << ", ";
     std::cout << "\noutMetadataFile: " << outMetadataFile << "\noutDataFile: " << outDataFile << '\n';
+    std::cout << "copy engine: " << CopyEngineName() << '\n';
 
-    std::vector<m_chunk*> metadata = std::vector<m_chunk*>(metadataFiles.size(), nullptr);
-    for(int i = 0; i != metadata.size(); ++i) {
-        metadata[i] = static_cast<m_chunk*>(mapFile(metadataFiles[i], M_CHUNK_COUNT * sizeof(m_chunk), false));
+    // start mapping every log now, merging picks them up in this order as they become ready
+    std::vector<MergeInput> inputs;
+    for(int i = 0; i != metadataFiles.size() && i != dataFiles.size(); ++i) {
+        std::size_t mappedLog = mapper.add(metadataFiles[i], dataFiles[i],
+                M_CHUNK_COUNT * sizeof(m_chunk), maxDataSize);
+        inputs.push_back(MergeInput{metadataFiles[i], dataFiles[i], false, static_cast<uint64_t>(maxDataSize), mappedLog});
     }
-
-    std::vector<void*> data = std::vector<void*>(dataFiles.size(), nullptr);
-    for(int i = 0; i != data.size(); ++i) {
-        data[i] = mapFile(dataFiles[i], maxDataSize, false);
+    for(const auto& indexName : indexFiles) {
+        std::string indexFile = bufferFolder + "/" + indexName;
+        m_extent_header header;
+        std::vector<m_extent> extents;
+        if(!readIndex(indexFile, header, extents)) continue;
+        inputs.push_back(MergeInput{indexFile, indexFile.substr(0, indexFile.size() - indexSuffix.size()),
+                true, header.data_size, 0});
     }
 
     void* outData = mapFile(outDataFile, maxDataSize, true);
+    if(outData == nullptr) return 1;
 
-    std::vector<int> startIndices = std::vector<int>(dataFiles.size(), 0);
-    std::vector<int> endIndices = std::vector<int>(dataFiles.size(), M_CHUNK_COUNT);
-    
-    int curEndOffset = 0;
+    if(cascade && fanIn < 2) fanIn = ChooseFanIn(inputs, maxStageBytes);
+    if(cascade) std::cout << "Cascading merge with fan-in " << fanIn << ".\n";
 
-    std::ofstream out{outFile};
+    // merge tree, every level merges groups of fanIn inputs into intermediate outputs
+    // until one stage can take all that is left. They go in a directory of their own,
+    // so they're never listed as inputs even if the out file is in the buffer folder
+    std::string intermediateFolder = outFile + ".cascade";
+    std::vector<std::string> intermediateFiles;
+    int level = 0;
+    if(cascade && inputs.size() > fanIn && mkdir(intermediateFolder.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cerr << "Unable to create \"" << intermediateFolder << "\"\n";
+        perror("Error:");
+        return 1;
+    }
+    while(cascade && inputs.size() > fanIn) {
+        std::vector<MergeInput> nextInputs;
+        for(int first = 0; first < inputs.size(); first += fanIn) {
+            std::vector<MergeInput> group{inputs.begin() + first,
+                inputs.begin() + std::min<std::size_t>(first + fanIn, inputs.size())};
+
+            std::string stageFile = intermediateFolder + "/L" + std::to_string(level) + "." + std::to_string(first / fanIn);
+            std::vector<m_extent> extents;
+            // a Full intermediate would allocate everything below its last extent, only the target is laid out in full
+            Preallocation stagePreallocate = layout.preallocate == Preallocation::Full ? Preallocation::Extents : layout.preallocate;
+            if(!MergeStage(group, stageFile, outData, maxDataSize, mapper,
+                        StageLayout{stagePreallocate, false, true}, extents)) return 1;
+            if(!writeIndex(stageFile + indexSuffix, extents)) return 1;
+
+            uint64_t dataSize = extents.empty() ? 0 : extents.back().data_offset + extents.back().length;
+            nextInputs.push_back(MergeInput{stageFile + indexSuffix, stageFile, true, dataSize, 0});
+            intermediateFiles.push_back(stageFile);
+            intermediateFiles.push_back(stageFile + indexSuffix);
+        }
+        std::cout << "Level " << level << " merged " << inputs.size() << " inputs into " << nextInputs.size() << ".\n";
+        inputs = std::move(nextInputs);
+        ++level;
+    }
 
     std::cout << "Merging data...\n";
-    Merger merger = MergeData(metadata, data, startIndices, endIndices,
-            outData, curEndOffset, maxDataSize, out);
-    merger.debugLog();
-    std::cout << "Merge complete.\n";
-
-    std::cout << "Writing data...\n";
-    // do final write
-    std::vector<char> buffer;
-    for(auto& item : merger.getItems()) {
-        auto& logItem = item.getLogItems()[0];
-        buffer.resize(item.getLength());
-        std::memcpy(buffer.data(), static_cast<char*>(outData) + logItem.item.data_offset,
-                item.getLength());
-        out.seekp(logItem.item.target_offset);
-        out.write(buffer.data(), item.getLength());
-    }
-
-    out.close();
+    if(layout.punchHoles && !layout.truncate) std::cout << "Not punching holes in an existing target.\n";
+    std::vector<m_extent> extents;
+    if(!MergeStage(inputs, outFile, outData, maxDataSize, mapper, layout, extents)) return 1;
     std::cout << "Write complete.\n";
 
+    if(!keepIntermediate && level != 0) {
+        for(const auto& file : intermediateFiles) std::remove(file.c_str());
+        // left in place if anything else was put there
+        rmdir(intermediateFolder.c_str());
+    }
+
+    if(outIndexFile != "") {
+        std::cout << "Out index file specified, writing merged extent index.\n";
+        if(!writeIndex(outIndexFile, extents)) return 1;
+    }
+
     if(outMetadataFile == "") return 0;
     std::cout << "Out metadata file specified, logging merged metadata.\n";
     std::vector<m_chunk> outChunks = std::vector<m_chunk>(M_CHUNK_COUNT, m_chunk{});
@@ -134,24 +395,36 @@ int main(int argc, char** argv) {
         chunk.item_count = 0;
         chunk.next_chunk = curChunk+1;
     }
-    outChunks[M_ITEM_COUNT - 1].next_chunk = 0;
+    outChunks[M_CHUNK_COUNT - 1].next_chunk = 0;
     int curChunkIndex = 0;
+    int usedChunks = 0;
 
-    for(auto& item : merger.getItems()) {
-        auto& curChunk = outChunks[curChunkIndex];
-        if(curChunk.free) {
-            curChunk.free = 0;
-            curChunk.item_count = 0;
-            curChunk.req_len = item.getLength();
+    // the data of each extent is in outFile at its target offset
+    for(auto& extent : extents) {
+        auto* curChunk = &outChunks[curChunkIndex];
+        // a chunk only has one request length
+        if(!curChunk->free && curChunk->req_len != extent.length) {
+            curChunkIndex = curChunk->next_chunk;
+            curChunk = &outChunks[curChunkIndex];
+        }
+        if(curChunk->free) {
+            if(usedChunks == M_CHUNK_COUNT) {
+                std::cerr << "Merged metadata doesn't fit in one ring, use --outIndexFile instead\n";
+                return 1;
+            }
+            ++usedChunks;
+            curChunk->free = 0;
+            curChunk->item_count = 0;
+            curChunk->req_len = extent.length;
         }
 
-        auto& curItem = curChunk.items[curChunk.item_count];
-        curItem.data_offset = item.getDataOffset();
-        curItem.target_offset = item.getBaseOffset();
+        auto& curItem = curChunk->items[curChunk->item_count];
+        curItem.data_offset = extent.data_offset;
+        curItem.target_offset = extent.target_offset;
 
-        ++curChunk.item_count;
-        if(curChunk.item_count == M_ITEM_COUNT) curChunkIndex = curChunk.next_chunk;
-    } 
+        ++curChunk->item_count;
+        if(curChunk->item_count == M_ITEM_COUNT) curChunkIndex = curChunk->next_chunk;
+    }
 
     std::ofstream mergedMetadataOut{outMetadataFile};
     if(!mergedMetadataOut.good()) {
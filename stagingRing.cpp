@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <iostream>
+
+#include "stagingRing.h"
+
+StagingRing::StagingRing(uint64_t capacity_) :
+    capacity{capacity_},
+    limit{capacity_},
+    head{0},
+    used{0}
+{}
+
+bool StagingRing::reserve(uint64_t length, uint64_t& offset) {
+    if(length == 0 || used + length > limit) return false;
+
+    if(reservations.empty()) {
+        head = 0;
+        if(length > capacity) return false;
+    }
+    else {
+        uint64_t tail = reservations.front().offset;
+        if(head > tail) {
+            // free space is [head, capacity) and [0, tail)
+            if(head + length > capacity) {
+                if(length > tail) return false;
+                uint64_t skipped = capacity - head;
+                if(used + skipped + length > limit) return false;
+                // wrap around, the skipped space goes back once everything before it is released
+                reservations.push_back(Reservation{head, skipped, true});
+                used += skipped;
+                head = 0;
+            }
+        }
+        // head has wrapped behind the tail, free space is [head, tail)
+        else if(head + length > tail) return false;
+    }
+
+    offset = head;
+    reservations.push_back(Reservation{head, length, false});
+    head += length;
+    used += length;
+    return true;
+}
+
+void StagingRing::release(uint64_t offset) {
+    // nearly always close to the front, writes finish roughly in order
+    auto iter = std::find_if(reservations.begin(), reservations.end(), [offset](const Reservation& reservation) {
+        return !reservation.released && reservation.offset == offset;
+    });
+    if(iter == reservations.end()) {
+        std::cerr << "stagingRing.cpp: Release of unknown reservation at " << offset << '\n';
+        return;
+    }
+    iter->released = true;
+
+    while(!reservations.empty() && reservations.front().released) {
+        used -= reservations.front().length;
+        reservations.pop_front();
+    }
+}
+
+void StagingRing::setLimit(uint64_t limit_) {
+    limit = std::min(limit_, capacity);
+}
+
+uint64_t StagingRing::getLimit() const {
+    return limit;
+}
+
+uint64_t StagingRing::getCapacity() const {
+    return capacity;
+}
+
+uint64_t StagingRing::getUsed() const {
+    return used;
+}
+
+uint64_t StagingRing::getLargestFree() const {
+    uint64_t contiguous;
+    if(reservations.empty()) contiguous = capacity;
+    else {
+        uint64_t tail = reservations.front().offset;
+        if(head > tail) {
+            contiguous = capacity - head;
+            // wrapping skips what's left at the end
+            if(used + contiguous < limit) contiguous = std::max(contiguous, std::min(tail, limit - used - contiguous));
+        }
+        else contiguous = tail - head;
+    }
+    return std::min(contiguous, used < limit ? limit - used : 0);
+}
@@ -0,0 +1,46 @@
+#ifndef STAGING_RING_H
+#define STAGING_RING_H
+
+#include <cstdint>
+#include <deque>
+
+/*
+ * Allocator for the outData staging area. Space is handed out as a circular buffer,
+ * one reservation per staged extent, and can be released in any order as writes
+ * complete. Space is reused as soon as everything older than it has been released.
+ */
+class StagingRing {
+public:
+    explicit StagingRing(uint64_t capacity);
+
+    // reserves length contiguous bytes, false if there isn't that much contiguous free space
+    bool reserve(uint64_t length, uint64_t& offset);
+    // releases the reservation starting at offset
+    void release(uint64_t offset);
+
+    // caps the bytes in use below capacity, reservations past it fail
+    void setLimit(uint64_t limit);
+    uint64_t getLimit() const;
+
+    uint64_t getCapacity() const;
+    // bytes reserved, including space skipped when wrapping around
+    uint64_t getUsed() const;
+    // the largest reservation that would currently succeed
+    uint64_t getLargestFree() const;
+
+private:
+    struct Reservation {
+        uint64_t offset;
+        uint64_t length;
+        bool released;
+    };
+
+    // in allocation order, the front is the tail of the ring
+    std::deque<Reservation> reservations;
+    uint64_t capacity;
+    uint64_t limit;
+    uint64_t head;
+    uint64_t used;
+};
+
+#endif
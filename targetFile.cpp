@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "targetFile.h"
+
+// a gap smaller than this shares its blocks with the data around it
+static const uint64_t minPunchLength = 4096;
+
+bool WriteTarget(int fd, const char* buffer, uint64_t length, uint64_t offset) {
+    while(length != 0) {
+        ssize_t written = pwrite(fd, buffer, length, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            perror("targetFile.cpp: pwrite");
+            return false;
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+std::vector<TargetRange> CoveredRanges(const MergerItem* first, const MergerItem* last) {
+    std::vector<TargetRange> ranges;
+    for(auto* item = first; item != last; ++item) {
+        uint64_t offset = item->getBaseOffset();
+        uint64_t length = item->getLength();
+        if(!ranges.empty() && ranges.back().offset + ranges.back().length >= offset) {
+            uint64_t end = std::max(ranges.back().offset + ranges.back().length, offset + length);
+            ranges.back().length = end - ranges.back().offset;
+        }
+        else ranges.push_back(TargetRange{offset, length});
+    }
+    return ranges;
+}
+
+static bool allocate(int fd, int mode, uint64_t offset, uint64_t length) {
+    while(fallocate(fd, mode, offset, length) != 0) {
+        if(errno == EINTR) continue;
+        perror("targetFile.cpp: fallocate");
+        return false;
+    }
+    return true;
+}
+
+bool PreallocateTarget(int fd, const std::vector<TargetRange>& ranges, Preallocation mode, uint64_t from) {
+    if(mode == Preallocation::None || ranges.empty()) return true;
+
+    if(mode == Preallocation::Full) {
+        uint64_t end = ranges.back().offset + ranges.back().length;
+        if(end <= from) return true;
+        return allocate(fd, 0, from, end - from);
+    }
+
+    for(const auto& range : ranges) {
+        if(!allocate(fd, 0, range.offset, range.length)) return false;
+    }
+    return true;
+}
+
+bool PunchGaps(int fd, const std::vector<TargetRange>& ranges) {
+    uint64_t gapStart = 0;
+    for(const auto& range : ranges) {
+        if(range.offset >= gapStart + minPunchLength &&
+                !allocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, gapStart, range.offset - gapStart)) {
+            return false;
+        }
+        gapStart = range.offset + range.length;
+    }
+    return true;
+}
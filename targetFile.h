@@ -0,0 +1,36 @@
+#ifndef TARGET_FILE_H
+#define TARGET_FILE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "mergerItem.h"
+
+// part of the target file a merge writes
+struct TargetRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// how much of the target is allocated before a destage writes to it
+enum class Preallocation {
+    None = 0, // blocks are allocated by the writes themselves
+    Extents = 1, // just the ranges the merged extents cover
+    Full = 2 // everything up to the end of the last extent
+};
+
+// pwrite all of buffer to offset, retrying short writes
+bool WriteTarget(int fd, const char* buffer, uint64_t length, uint64_t offset);
+
+// the ranges [first, last) cover, adjacent items coalesced, items must be sorted
+std::vector<TargetRange> CoveredRanges(const MergerItem* first, const MergerItem* last);
+
+// fallocates the ranges, or with Full everything from `from` up to the end of the last one
+// returns false if the filesystem can't, the writes allocate as they go then
+bool PreallocateTarget(int fd, const std::vector<TargetRange>& ranges, Preallocation mode, uint64_t from = 0);
+
+// deallocates the gaps between the ranges, keeping the file size
+// only for a freshly created target, anything in the gaps is lost
+bool PunchGaps(int fd, const std::vector<TargetRange>& ranges);
+
+#endif